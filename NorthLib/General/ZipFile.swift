@@ -9,7 +9,7 @@
 import Foundation
 
 /// A class for handling zip-packed files
-open class ZipFile {
+open class ZipFile: DoesLog {
   
   var zipStream: ZipStream
   var zipFile: String
@@ -20,20 +20,16 @@ open class ZipFile {
     self.zipStream = ZipStream()
   }
   
-  /// Unpack to given directory
-  public func unpack(toDir dir: String) {
-    zipStream.onFile { (name, data) in
-      guard let name = name, let data = data else { return }
-      let path = "\(dir)/\(name)"
-      Dir(File.dirname(path)).create()
-      File(path).data = data
-    }
-    File.open(path: zipFile, mode: "r") { [weak self] file in
-      guard let self = self else { return }
-      while let data = file.read() {
-        self.zipStream.scanData(data)
-      }
+  /// Unpack to given directory, returns false if the file can't be read
+  /// or isn't a valid zip archive
+  @discardableResult
+  public func unpack(toDir dir: String) -> Bool {
+    zipStream.extract(toDir: dir)
+    guard zipStream.scanFile(zipFile) else {
+      error("Can't unpack \(zipFile) to \(dir)")
+      return false
     }
+    return true
   }
   
 }
@@ -16,10 +16,40 @@
 /// total number of bytes given to 'scanData'
 @property (nonatomic,assign) long bytesReceived;
 
+/// files larger than this are kept in temporary files (0: no limit)
+@property (nonatomic,assign) long memoryLimit;
+
+/// statistics of the data scanned so far (see zip::StreamStats), the keys
+/// are the names of the StreamStats fields
+@property (nonatomic,readonly) NSDictionary<NSString *, NSNumber *> *stats;
+
 /// scans the given data for enclosed zipped files
 - (void) scanData: (NSData *) data;
 
+/// scans the zip archive in the given file (mapped into memory), returns
+/// NO if the file can't be opened or the archive is corrupt
+- (BOOL) scanFile: (NSString *) path;
+
+/// saves the state of the stream, 'offset' receives the position in the
+/// zip archive to continue the download at (nil: not possible right now)
+- (NSData *) checkpoint: (long *) offset;
+
+/// restores a state saved by 'checkpoint' (call 'extractToDir' before),
+/// returns NO if 'state' isn't a valid checkpoint, the stream then starts
+/// over at the beginning of the archive
+- (BOOL) restore: (NSData *) state;
+
 /// closure to call when file encountered in zip stream
 - (void) onFile: (void (^)(NSString *name, NSData *data1)) closure;
 
+/// closure to call with batches of files encountered in zip stream (instead
+/// of the onFile closure), a batch is passed at the latest when 'scanData'
+/// returns
+- (void) onFiles: (void (^)(NSArray<NSString *> *names, 
+                            NSArray<NSData *> *data)) closure;
+
+/// writes the files encountered in the zip stream directly to the given
+/// directory (instead of calling the onFile closure)
+- (void) extractToDir: (NSString *) dir NS_SWIFT_NAME(extract(toDir:));
+
 @end
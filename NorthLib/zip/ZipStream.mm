@@ -5,6 +5,7 @@
 //  Copyright (c) 2013 Norbert Thies. All rights reserved.
 //
 
+#include <memory>
 #include "zip.hh"
 #import  "ZipStream.h"
 
@@ -12,13 +13,19 @@ class ZipDelegate;
 
 @interface ZipStream ()
 @property (copy) void (^onFileClosure)(NSString *, NSData *);
+@property (copy) void (^onFilesClosure)(NSArray<NSString *> *, 
+                                        NSArray<NSData *> *);
 @end
 
+// batches passed to the onFiles closure
+enum { BatchFiles = 256, BatchBytes = 4*1024*1024 };
+
 @implementation ZipStream
 
 {
   zip::Stream *_zipStream;
   ZipDelegate *_zipStreamDelegate;
+  zip::Extractor *_extractor;
 }
 
 // Getters and setters
@@ -33,24 +40,117 @@ class ZipDelegate;
 - (zip::Stream *) zipStream {
   if ( !_zipStream ) {
     _zipStream = new zip::Stream( *(self.zipStreamDelegate) );
+    _zipStream -> setMemoryLimit( _memoryLimit );
+    if ( _onFilesClosure ) _zipStream -> setBatching( BatchFiles, BatchBytes );
     _bytesReceived = 0;
     _bytesProcessed = 0;
   }
   return _zipStream;
 }
 
+- (void) setMemoryLimit: (long) limit {
+  _memoryLimit = limit;
+  if ( _zipStream ) _zipStream -> setMemoryLimit( limit );
+}
+
 - (void) scanData: (NSData *) data {
   self.zipStream -> scan( (const char *) data.bytes, (int) data.length );
   _bytesReceived += data.length;
+  if ( _extractor ) _bytesProcessed = _zipStream -> bytesRead();
+}
+
+- (BOOL) scanFile: (NSString *) path {
+  // C++ exceptions must not propagate through ObjC into Swift
+  try {
+    zip::FileSource source( path.UTF8String );
+    // a restored stream continues at the offset of its checkpoint
+    long offset = self.zipStream -> bytesRead();
+    _bytesReceived += source.size() - offset;
+    source.scan( *_zipStream, offset );
+  }
+  catch ( std::exception & ) { 
+    if ( _zipStream ) _bytesProcessed = _zipStream -> bytesRead();
+    return NO; 
+  }
+  _bytesProcessed = _zipStream -> bytesRead();
+  return YES;
+}
+
+- (NSData *) checkpoint: (long *) offset {
+  std::string state;
+  try { *offset = self.zipStream -> checkpoint( state ); }
+  catch ( std::exception & ) { *offset = -1; }
+  if ( *offset < 0 ) return nil;
+  return [NSData dataWithBytes:state.data() length:state.size()];
+}
+
+- (BOOL) restore: (NSData *) state {
+  try {
+    self.zipStream -> restore( std::string( (const char *) state.bytes, 
+                                            state.length ) );
+  }
+  catch ( std::exception & ) {
+    // the Stream may be restored partially, so start over
+    [self resetStream];
+    return NO;
+  }
+  _bytesReceived = _bytesProcessed = _zipStream -> bytesRead();
+  return YES;
+}
+
+- (NSDictionary<NSString *, NSNumber *> *) stats {
+  zip::StreamStats st = self.zipStream -> stats();
+  return @{
+    @"files": @(st.files),
+    @"skippedFiles": @(st.skippedFiles),
+    @"bytesSkipped": @(st.bytesSkipped),
+    @"bytesCopied": @(st.bytesCopied),
+    @"bytesDirect": @(st.bytesDirect),
+    @"bytesInflated": @(st.bytesInflated),
+    @"reallocs": @(st.reallocs),
+    @"bytesMoved": @(st.bytesMoved),
+    @"scan": @(st.scan),
+    @"decode": @(st.decode),
+    @"delegate": @(st.delegate)
+  };
+}
+
+// replaces the zip::Stream by a new one (writing to the Extractor if any)
+- (void) resetStream {
+  if ( _zipStream ) delete _zipStream;
+  _zipStream = 0;
+  if ( _extractor ) {
+    _zipStream = new zip::Stream( *_extractor );
+    _zipStream -> setStreaming();
+    _zipStream -> setMemoryLimit( _memoryLimit );
+  }
+  _bytesReceived = 0;
+  _bytesProcessed = 0;
+}
+
+- (void) extractToDir: (NSString *) dir {
+  if ( _zipStream ) delete _zipStream;
+  _zipStream = 0;
+  if ( _extractor ) delete _extractor;
+  _extractor = new zip::Extractor( dir.UTF8String );
+  [self resetStream];
 }
 
 - (void) onFile:(void (^)(NSString *, NSData *))closure {
   self.onFileClosure = closure;
 }
 
+- (void) onFiles:(void (^)(NSArray<NSString *> *, NSArray<NSData *> *))closure {
+  self.onFilesClosure = closure;
+  if ( _zipStream && !_extractor ) 
+    _zipStream -> setBatching( closure? BatchFiles : 0, 
+                               closure? BatchBytes : 0 );
+}
+
 - (void) dealloc {
   if ( _zipStream ) delete _zipStream;
   if ( _zipStreamDelegate ) delete _zipStreamDelegate;
+  if ( _extractor ) delete _extractor;
 }
 
 class ZipDelegate : public zip::StreamDelegate {
@@ -58,17 +158,44 @@ private:
   ZipStream *_stream;
 public:
   ZipDelegate( ZipStream *stream ) { _stream = stream; };
-  void handleFile( zip::File *file );
+  void handleFile( zip::FilePtr file );
+  void handleFiles( zip::FilePtr *files, int n );
 };
 
-void ZipDelegate::handleFile( zip::File *file ) {
-  NSData *data = [NSData dataWithBytes:file->data() length:file->size()];
+// wraps the data of the File into an NSData without copying it
+static NSData *fileData( zip::File *file ) {
+  zip::Payload payload = file->release();
+  if ( !payload.data ) return [NSData data];
+  return [[NSData alloc] initWithBytesNoCopy:payload.data 
+                         length:payload.size
+                         deallocator:^(void *bytes, NSUInteger length) {
+                           payload.dispose();
+                         }];
+}
+
+void ZipDelegate::handleFile( zip::FilePtr file ) {
+  NSData *data = fileData( file.get() );
   NSString *fname = [NSString stringWithUTF8String:file->name()];
+  file.reset();
   _stream.bytesProcessed = _stream -> _zipStream -> bytesRead();
   if ( _stream -> _onFileClosure ) 
     _stream -> _onFileClosure( fname, data );
-  delete file;
 }
 
+void ZipDelegate::handleFiles( zip::FilePtr *files, int n ) {
+  if ( !_stream -> _onFilesClosure ) {
+    zip::StreamDelegate::handleFiles( files, n );
+    return;
+  }
+  NSMutableArray<NSString *> *names = [NSMutableArray arrayWithCapacity:n];
+  NSMutableArray<NSData *> *data = [NSMutableArray arrayWithCapacity:n];
+  for ( int i = 0; i < n; i++ ) {
+    [names addObject:[NSString stringWithUTF8String:files[i]->name()]];
+    [data addObject:fileData( files[i].get() )];
+    files[i].reset();
+  }
+  _stream.bytesProcessed = _stream -> _zipStream -> bytesRead();
+  _stream -> _onFilesClosure( names, data );
+}
 
 @end
@@ -1,6 +1,49 @@
 #include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <condition_variable>
+#include <time.h>
 #include "zip.hh"
 
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define ZIP_SIMD_X86
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define ZIP_SIMD_NEON
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#  include <arm_acle.h>
+#endif
+
+// optional decompression libraries (link with -lzstd, -lbz2 resp. -llzma),
+// the Xcode project enables bzip2 and LZMA which are part of the iOS SDK
+#ifdef ZIP_HAVE_ZSTD
+#  include <zstd.h>
+#endif
+#ifdef ZIP_HAVE_BZIP2
+#  include <bzlib.h>
+#endif
+#ifdef ZIP_HAVE_LZMA
+#  include <lzma.h>
+#endif
+
 #undef DEBUG
 
 // a simple debug macro
@@ -117,12 +160,15 @@ class Header {
     Lzma		= 14,	// LZMA data compression
     IbmTerse		= 18,	// IBM Terse data compression
     Lz77		= 19,	// IBM LZ77 data compression
+    Zstd		= 93,	// Zstandard compression
     WavPack		= 97,	// WavPack compression
     PPMd		= 98	// PPMd compression
   };
 
   unsigned flags(void) const { return bytes2number(_flags); }
   unsigned compression(void) const { return bytes2number(_compression); }
+  unsigned mtime(void) const { return bytes2number(_mtime); }
+  unsigned mdate(void) const { return bytes2number(_mdate); }
   unsigned crc32(void) const { return bytes2number(_crc32); }
   unsigned csize(void) const { return bytes2number(_csize); }
   unsigned size(void) const { return bytes2number(_size); }
@@ -131,9 +177,20 @@ class Header {
   unsigned hsize(void) const
     { return sizeof(Header) + fnlength() + extralength(); }
 
+  // modification time (DOS time is local time)
+  time_t modified(void) const;
+
+  // file name (not zero terminated) following the fixed length part
+  const char *filename(void) const
+    { return ((const char *) this) + sizeof(Header); }
+  char *heapFilename(void) const;
+
   void setDataDescriptor( DataDescriptor *dd )
     { _size = dd -> _size; _csize = dd -> _csize; _crc32 = dd -> _crc32; }
 
+  template <class H> void setSizes( const H *h )
+    { _size = h -> _size; _csize = h -> _csize; _crc32 = h -> _crc32; }
+
   int hasSize(void) const { return !(flags() & DescriptorUsed); }
 
   int toAscii( char *buff, int len );
@@ -141,14 +198,677 @@ class Header {
 };  // class Header
 
 
-// zip Header and DataDescriptor signatures:
+/**
+ *  Header of a file in the central directory (central directory header)
+ *  A central directory header is followed by the file name, the extra
+ *  field and the file comment.
+ */
+
+class DirHeader {
+
+  friend class Header;
+  private:
+  tByte4 _signature;	// 0x02014b50
+  tByte2 _madeby;	// version made by
+  tByte2 _version;	// version of PKZIP specification needed to extract
+  tByte2 _flags;	// bit flags
+  tByte2 _compression;	// compression method used
+  tByte2 _mtime;	// DOS modification time
+  tByte2 _mdate;	// DOS modification date
+  tByte4 _crc32;	// CRC-32 checksum
+  tByte4 _csize;	// compressed file size
+  tByte4 _size;		// uncompressed file size
+  tByte2 _fnlength;	// length of file name
+  tByte2 _extralength;	// length of extra field
+  tByte2 _cmtlength;	// length of file comment
+  tByte2 _disk;		// disk number start
+  tByte2 _iattr;	// internal file attributes
+  tByte4 _eattr;	// external file attributes
+  tByte4 _offset;	// relative offset of local header
+
+  public:
+  static const tByte signature[4];
+
+  unsigned flags(void) const { return bytes2number(_flags); }
+  unsigned compression(void) const { return bytes2number(_compression); }
+  unsigned crc32(void) const { return bytes2number(_crc32); }
+  unsigned csize(void) const { return bytes2number(_csize); }
+  unsigned size(void) const { return bytes2number(_size); }
+  unsigned fnlength(void) const { return bytes2number(_fnlength); }
+  unsigned offset(void) const { return bytes2number(_offset); }
+  unsigned hsize(void) const {
+    return sizeof(DirHeader) + fnlength() + bytes2number(_extralength) +
+           bytes2number(_cmtlength);
+  }
+  const char *filename(void) const
+    { return ((const char *) this) + sizeof(DirHeader); }
+
+};  // class DirHeader
+
+
+/**
+ *  End of central directory record
+ *  (followed by a variable length comment)
+ */
+
+class EndOfDir {
+
+  private:
+  tByte4 _signature;	// 0x06054b50
+  tByte2 _disk;		// number of this disk
+  tByte2 _dirdisk;	// disk where central directory starts
+  tByte2 _ndiskentries;	// number of central directory entries on this disk
+  tByte2 _nentries;	// total number of central directory entries
+  tByte4 _dirsize;	// size of central directory
+  tByte4 _diroffset;	// offset of start of central directory
+  tByte2 _cmtlength;	// length of archive comment
+
+  public:
+  static const tByte signature[4];
+
+  unsigned nentries(void) const { return bytes2number(_nentries); }
+  unsigned dirsize(void) const { return bytes2number(_dirsize); }
+  unsigned diroffset(void) const { return bytes2number(_diroffset); }
+  int isZip64(void) const {
+    return (nentries() == 0xffff) || (dirsize() == 0xffffffff) ||
+           (diroffset() == 0xffffffff);
+  }
+
+};  // class EndOfDir
+
+
+// zip Header, DataDescriptor and central directory signatures:
 const tByte Header::signature[] = { 0x50, 0x4b, 0x03, 0x04 };
 const tByte DataDescriptor::signature[] = { 0x50, 0x4b, 0x07, 0x08 };
+const tByte DirHeader::signature[] = { 0x50, 0x4b, 0x01, 0x02 };
+const tByte EndOfDir::signature[] = { 0x50, 0x4b, 0x05, 0x06 };
+
+
+/**
+ *  findSignature searches the bytes in [data, end) for the 4 byte signature 
+ *  'sig' and returns a pointer to its first occurrence. If the signature is 
+ *  not found, a pointer to the longest suffix of the data which is a prefix 
+ *  of the signature is returned (or end if there is no such suffix).
+ *  The search is done by a kernel chosen at runtime: AVX2 or SSE2 on x86, 
+ *  NEON on ARM or a memchr based loop otherwise. The vector kernels look 
+ *  for the first two signature bytes a block at a time and leave the tail
+ *  of the data to the scalar kernel.
+ */
+
+typedef const tByte *(*tFindSignature)( const tByte *data, const tByte *end,
+                                        const tByte *sig );
+
+static const tByte *findSignatureScalar( const tByte *data, const tByte *end,
+                                         const tByte *sig ) {
+  while ( data < end ) {
+    const tByte *p = (const tByte *) memchr( data, sig[0], end - data );
+    if ( !p ) break;
+    int n = (end - p < 4)? (int)(end - p) : 4;
+    if ( memcmp( p, sig, n ) == 0 ) return p;
+    data = p + 1;
+  }
+  return end;
+}
+
+#if defined(ZIP_SIMD_X86)
+
+__attribute__((target("sse2")))
+static const tByte *findSignatureSSE2( const tByte *data, const tByte *end,
+                                       const tByte *sig ) {
+  const __m128i s0 = _mm_set1_epi8( (char) sig[0] );
+  const __m128i s1 = _mm_set1_epi8( (char) sig[1] );
+  while ( end - data >= 17 ) {
+    __m128i a = _mm_loadu_si128( (const __m128i *) data );
+    __m128i b = _mm_loadu_si128( (const __m128i *) (data + 1) );
+    unsigned mask = (unsigned) _mm_movemask_epi8( 
+      _mm_and_si128( _mm_cmpeq_epi8( a, s0 ), _mm_cmpeq_epi8( b, s1 ) ) );
+    while ( mask ) {
+      const tByte *p = data + __builtin_ctz( mask );
+      if ( end - p < 4 ) return findSignatureScalar( p, end, sig );
+      if ( memcmp( p, sig, 4 ) == 0 ) return p;
+      mask &= mask - 1;
+    }
+    data += 16;
+  }
+  return findSignatureScalar( data, end, sig );
+}
+
+__attribute__((target("avx2")))
+static const tByte *findSignatureAVX2( const tByte *data, const tByte *end,
+                                       const tByte *sig ) {
+  const __m256i s0 = _mm256_set1_epi8( (char) sig[0] );
+  const __m256i s1 = _mm256_set1_epi8( (char) sig[1] );
+  while ( end - data >= 33 ) {
+    __m256i a = _mm256_loadu_si256( (const __m256i *) data );
+    __m256i b = _mm256_loadu_si256( (const __m256i *) (data + 1) );
+    unsigned mask = (unsigned) _mm256_movemask_epi8( 
+      _mm256_and_si256( _mm256_cmpeq_epi8( a, s0 ), 
+                        _mm256_cmpeq_epi8( b, s1 ) ) );
+    while ( mask ) {
+      const tByte *p = data + __builtin_ctz( mask );
+      if ( end - p < 4 ) return findSignatureScalar( p, end, sig );
+      if ( memcmp( p, sig, 4 ) == 0 ) return p;
+      mask &= mask - 1;
+    }
+    data += 32;
+  }
+  return findSignatureSSE2( data, end, sig );
+}
+
+#elif defined(ZIP_SIMD_NEON)
+
+// returns true if any byte of m is non-zero, vmaxvq_u8 exists on AArch64 
+// only, 32 bit ARM reduces the halves by pairwise maxima
+static inline bool anyNEON( uint8x16_t m ) {
+#if defined(__aarch64__)
+  return vmaxvq_u8( m ) != 0;
+#else
+  uint8x8_t r = vpmax_u8( vget_low_u8( m ), vget_high_u8( m ) );
+  r = vpmax_u8( r, r );
+  r = vpmax_u8( r, r );
+  r = vpmax_u8( r, r );
+  return vget_lane_u8( r, 0 ) != 0;
+#endif
+}
+
+static const tByte *findSignatureNEON( const tByte *data, const tByte *end,
+                                       const tByte *sig ) {
+  const uint8x16_t s0 = vdupq_n_u8( sig[0] );
+  const uint8x16_t s1 = vdupq_n_u8( sig[1] );
+  while ( end - data >= 17 ) {
+    uint8x16_t a = vld1q_u8( data );
+    uint8x16_t b = vld1q_u8( data + 1 );
+    uint8x16_t m = vandq_u8( vceqq_u8( a, s0 ), vceqq_u8( b, s1 ) );
+    if ( anyNEON( m ) ) {
+      for ( const tByte *p = data; p < data + 16; p++ ) {
+        if ( p[0] != sig[0] || p[1] != sig[1] ) continue;
+        if ( end - p < 4 ) return findSignatureScalar( p, end, sig );
+        if ( memcmp( p, sig, 4 ) == 0 ) return p;
+    } }
+    data += 16;
+  }
+  return findSignatureScalar( data, end, sig );
+}
+
+#endif
+
+static tFindSignature selectFindSignature( void ) {
+#if defined(ZIP_SIMD_X86)
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "avx2" ) ) return findSignatureAVX2;
+  if ( __builtin_cpu_supports( "sse2" ) ) return findSignatureSSE2;
+  return findSignatureScalar;
+#elif defined(ZIP_SIMD_NEON)
+  return findSignatureNEON;
+#else
+  return findSignatureScalar;
+#endif
+}
+
+static const tByte *findSignature( const tByte *data, const tByte *end,
+                                   const tByte *sig ) {
+  static const tFindSignature kernel = selectFindSignature();
+  return kernel( data, end, sig );
+}
+
+
+/**
+ *  crc32Update updates the CRC-32 crc (as defined by zip and libz' crc32)
+ *  with len bytes of data. The kernel is chosen at runtime: the ARMv8 CRC32
+ *  instructions, carry-less multiplication (PCLMULQDQ) folding on x86 or 
+ *  table driven slice-by-8 otherwise.
+ */
+
+typedef uint32_t (*tCrc32)( uint32_t crc, const tByte *data, long len );
+
+// tables for slice-by-8, _crcTable[0] is the classic byte wise table
+static uint32_t _crcTable[8][256];
+
+static void crcInitTable( void ) {
+  for ( uint32_t i = 0; i < 256; i++ ) {
+    uint32_t c = i;
+    for ( int k = 0; k < 8; k++ ) c = (c & 1)? (c >> 1) ^ 0xedb88320 : c >> 1;
+    _crcTable[0][i] = c;
+  }
+  for ( uint32_t i = 0; i < 256; i++ )
+    for ( int t = 1; t < 8; t++ )
+      _crcTable[t][i] = (_crcTable[t-1][i] >> 8) ^ 
+                        _crcTable[0][_crcTable[t-1][i] & 0xff];
+}
+
+static uint32_t crc32Slice8( uint32_t crc, const tByte *data, long len ) {
+  crc = ~crc;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  while ( (len > 0) && ((uintptr_t) data & 7) ) {
+    crc = _crcTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  while ( len >= 8 ) {
+    uint32_t lo, hi;
+    memcpy( &lo, data, 4 );
+    memcpy( &hi, data + 4, 4 );
+    lo ^= crc;
+    crc = _crcTable[7][lo & 0xff] ^ _crcTable[6][(lo >> 8) & 0xff] ^
+          _crcTable[5][(lo >> 16) & 0xff] ^ _crcTable[4][lo >> 24] ^
+          _crcTable[3][hi & 0xff] ^ _crcTable[2][(hi >> 8) & 0xff] ^
+          _crcTable[1][(hi >> 16) & 0xff] ^ _crcTable[0][hi >> 24];
+    data += 8;
+    len -= 8;
+  }
+#endif
+  while ( len-- > 0 ) crc = _crcTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+#if defined(__ARM_FEATURE_CRC32)
+
+static uint32_t crc32ARM( uint32_t crc, const tByte *data, long len ) {
+  crc = ~crc;
+  while ( (len > 0) && ((uintptr_t) data & 7) ) {
+    crc = __crc32b( crc, *data++ );
+    len--;
+  }
+  while ( len >= 8 ) {
+    uint64_t w;
+    memcpy( &w, data, 8 );
+    crc = __crc32d( crc, w );
+    data += 8;
+    len -= 8;
+  }
+  while ( len-- > 0 ) crc = __crc32b( crc, *data++ );
+  return ~crc;
+}
+
+#elif defined(ZIP_SIMD_X86)
+
+/**
+ *  crc32PCLMUL folds 64 bytes per iteration using carry-less multiplication
+ *  as described in Intel's "Fast CRC Computation for Generic Polynomials 
+ *  Using PCLMULQDQ Instruction" (bit reflected constants for CRC-32). 
+ *  The tail of less than 16 bytes is left to crc32Slice8.
+ */
+
+__attribute__((target("sse4.1,pclmul")))
+static uint32_t crc32PCLMUL( uint32_t crc, const tByte *data, long len ) {
+  static const uint64_t k1k2[2] __attribute__((aligned(16))) = 
+    { 0x0154442bd4, 0x01c6e41596 };
+  static const uint64_t k3k4[2] __attribute__((aligned(16))) = 
+    { 0x01751997d0, 0x00ccaa009e };
+  static const uint64_t k5k0[2] __attribute__((aligned(16))) = 
+    { 0x0163cd6124, 0x0000000000 };
+  static const uint64_t poly[2] __attribute__((aligned(16))) = 
+    { 0x01db710641, 0x01f7011641 };
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+  if ( len < 64 ) return crc32Slice8( crc, data, len );
+  crc = ~crc;
+  x1 = _mm_loadu_si128( (const __m128i *) (data + 0x00) );
+  x2 = _mm_loadu_si128( (const __m128i *) (data + 0x10) );
+  x3 = _mm_loadu_si128( (const __m128i *) (data + 0x20) );
+  x4 = _mm_loadu_si128( (const __m128i *) (data + 0x30) );
+  x1 = _mm_xor_si128( x1, _mm_cvtsi32_si128( (int) crc ) );
+  x0 = _mm_load_si128( (const __m128i *) k1k2 );
+  data += 64;
+  len -= 64;
+  // fold 4 blocks of 16 bytes in parallel
+  while ( len >= 64 ) {
+    x5 = _mm_clmulepi64_si128( x1, x0, 0x00 );
+    x6 = _mm_clmulepi64_si128( x2, x0, 0x00 );
+    x7 = _mm_clmulepi64_si128( x3, x0, 0x00 );
+    x8 = _mm_clmulepi64_si128( x4, x0, 0x00 );
+    x1 = _mm_clmulepi64_si128( x1, x0, 0x11 );
+    x2 = _mm_clmulepi64_si128( x2, x0, 0x11 );
+    x3 = _mm_clmulepi64_si128( x3, x0, 0x11 );
+    x4 = _mm_clmulepi64_si128( x4, x0, 0x11 );
+    y5 = _mm_loadu_si128( (const __m128i *) (data + 0x00) );
+    y6 = _mm_loadu_si128( (const __m128i *) (data + 0x10) );
+    y7 = _mm_loadu_si128( (const __m128i *) (data + 0x20) );
+    y8 = _mm_loadu_si128( (const __m128i *) (data + 0x30) );
+    x1 = _mm_xor_si128( _mm_xor_si128( x1, x5 ), y5 );
+    x2 = _mm_xor_si128( _mm_xor_si128( x2, x6 ), y6 );
+    x3 = _mm_xor_si128( _mm_xor_si128( x3, x7 ), y7 );
+    x4 = _mm_xor_si128( _mm_xor_si128( x4, x8 ), y8 );
+    data += 64;
+    len -= 64;
+  }
+  // fold into 128 bits
+  x0 = _mm_load_si128( (const __m128i *) k3k4 );
+  x5 = _mm_clmulepi64_si128( x1, x0, 0x00 );
+  x1 = _mm_clmulepi64_si128( x1, x0, 0x11 );
+  x1 = _mm_xor_si128( _mm_xor_si128( x1, x2 ), x5 );
+  x5 = _mm_clmulepi64_si128( x1, x0, 0x00 );
+  x1 = _mm_clmulepi64_si128( x1, x0, 0x11 );
+  x1 = _mm_xor_si128( _mm_xor_si128( x1, x3 ), x5 );
+  x5 = _mm_clmulepi64_si128( x1, x0, 0x00 );
+  x1 = _mm_clmulepi64_si128( x1, x0, 0x11 );
+  x1 = _mm_xor_si128( _mm_xor_si128( x1, x4 ), x5 );
+  // fold single blocks of 16 bytes
+  while ( len >= 16 ) {
+    x2 = _mm_loadu_si128( (const __m128i *) data );
+    x5 = _mm_clmulepi64_si128( x1, x0, 0x00 );
+    x1 = _mm_clmulepi64_si128( x1, x0, 0x11 );
+    x1 = _mm_xor_si128( _mm_xor_si128( x1, x2 ), x5 );
+    data += 16;
+    len -= 16;
+  }
+  // fold 128 bits to 64 bits
+  x2 = _mm_clmulepi64_si128( x1, x0, 0x10 );
+  x3 = _mm_setr_epi32( ~0, 0, ~0, 0 );
+  x1 = _mm_srli_si128( x1, 8 );
+  x1 = _mm_xor_si128( x1, x2 );
+  x0 = _mm_loadl_epi64( (const __m128i *) k5k0 );
+  x2 = _mm_srli_si128( x1, 4 );
+  x1 = _mm_and_si128( x1, x3 );
+  x1 = _mm_clmulepi64_si128( x1, x0, 0x00 );
+  x1 = _mm_xor_si128( x1, x2 );
+  // Barrett reduction to 32 bits
+  x0 = _mm_load_si128( (const __m128i *) poly );
+  x2 = _mm_and_si128( x1, x3 );
+  x2 = _mm_clmulepi64_si128( x2, x0, 0x10 );
+  x2 = _mm_and_si128( x2, x3 );
+  x2 = _mm_clmulepi64_si128( x2, x0, 0x00 );
+  x1 = _mm_xor_si128( x1, x2 );
+  crc = ~(uint32_t) _mm_extract_epi32( x1, 1 );
+  return crc32Slice8( crc, data, len );
+}
+
+#endif
+
+static tCrc32 selectCrc32( void ) {
+  crcInitTable();
+#if defined(__ARM_FEATURE_CRC32)
+  return crc32ARM;
+#elif defined(ZIP_SIMD_X86)
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "pclmul" ) && __builtin_cpu_supports( "sse4.1" ) )
+    return crc32PCLMUL;
+  return crc32Slice8;
+#else
+  return crc32Slice8;
+#endif
+}
+
+static unsigned long crc32Update( unsigned long crc, const tByte *data, 
+                                  long len ) {
+  static const tCrc32 kernel = selectCrc32();
+  return kernel( (uint32_t) crc, data, len );
+}
+
+// size of the windows processed while the output is still in cache
+static const long CrcWindow = 32*1024;
+
+/**
+ *  copyCrc copies len bytes from src to dst and updates the CRC-32 crc
+ *  window by window.
+ */
+
+static unsigned long copyCrc( tByte *dst, const tByte *src, long len,
+                              unsigned long crc ) {
+  while ( len > 0 ) {
+    long n = (len < CrcWindow)? len : CrcWindow;
+    memcpy( dst, src, n );
+    crc = crc32Update( crc, dst, n );
+    dst += n; src += n; len -= n;
+  }
+  return crc;
+}
+
+
+/**
+ *  writeAll writes len bytes to the file descriptor fd.
+ */
+
+static void writeAll( int fd, const void *data, long len ) {
+  const char *p = (const char *) data;
+  while ( len > 0 ) {
+    ssize_t n = ::write( fd, p, len );
+    if ( n < 0 ) {
+      if ( errno == EINTR ) continue;
+      throw Exception( "can't write file" );
+    }
+    p += n; len -= n;
+  }
+}
+
+
+/**
+ *  A Spill is a temporary file holding data which exceeds the memory limit
+ *  of a Stream. Small appends are collected in a buffer of BufSize bytes. 
+ *  The data may be handed over to a File (see Spill::file), which maps it
+ *  and removes the temporary file when deleted. Otherwise the temporary 
+ *  file is removed with the Spill.
+ */
+
+class Spill {
+
+  public:
+  int		 _fd;		// temporary file
+  char		*_path;		// its path (0: handed over to a File)
+  long		 _len;		// total #bytes stored
+  tByte		*_buf;		// write buffer
+  int		 _buflen;	// #bytes in _buf
+  void		*_map;		// mapped data (see map)
+
+  enum { BufSize = 256*1024 };
+
+  Spill( const std::string &dir );
+  ~Spill();
+
+  // appends n bytes
+  void append( const tByte *data, long n );
+
+  // removes n bytes from the end
+  void trim( long n );
+
+  // writes the buffered bytes to the file
+  void flush( void );
+
+  // maps the data stored (read-only), unmap releases the mapping
+  const tByte *map( void );
+  void unmap( void );
+
+  // returns a File with the given Header backed by the data stored
+  FilePtr file( const Header *h, bool raw );
+
+}; // class Spill
+
+Spill::Spill( const std::string &dir ) {
+  const char *tmp = getenv( "TMPDIR" );
+  std::string path = dir.empty()? (tmp? tmp : "/tmp") : dir;
+  path += "/zipXXXXXX";
+  _path = strdup( path.c_str() );
+  if ( !_path ) throw Exception();
+  if ( (_fd = mkstemp( _path )) < 0 ) {
+    free( _path );
+    throw Exception( "can't create temporary file" );
+  }
+  _len = _buflen = 0;
+  _map = 0;
+  if ( !(_buf = (tByte *) malloc( BufSize )) ) {
+    close( _fd ); unlink( _path ); free( _path );
+    throw Exception();
+} }
+
+Spill::~Spill() {
+  unmap();
+  close( _fd );
+  if ( _path ) { unlink( _path ); free( _path ); }
+  free( _buf );
+}
+
+void Spill::append( const tByte *data, long n ) {
+  if ( _buflen + n > BufSize ) flush();
+  if ( n >= BufSize ) writeAll( _fd, data, n );
+  else { memcpy( _buf + _buflen, data, n ); _buflen += (int) n; }
+  _len += n;
+}
+
+void Spill::trim( long n ) {
+  if ( n > _len ) n = _len;
+  if ( n <= _buflen ) _buflen -= (int) n;
+  else {
+    flush();
+    if ( ftruncate( _fd, _len - n ) ) throw Exception( "can't write file" );
+    lseek( _fd, 0, SEEK_END );
+  }
+  _len -= n;
+}
+
+void Spill::flush( void ) {
+  if ( _buflen > 0 ) writeAll( _fd, _buf, _buflen );
+  _buflen = 0;
+}
+
+const tByte *Spill::map( void ) {
+  flush();
+  unmap();
+  if ( _len == 0 ) return 0;
+  _map = mmap( 0, _len, PROT_READ, MAP_SHARED, _fd, 0 );
+  if ( _map == MAP_FAILED ) { _map = 0; throw Exception( "can't map file" ); }
+  madvise( _map, _len, MADV_SEQUENTIAL );
+  return (const tByte *) _map;
+}
+
+void Spill::unmap( void ) {
+  if ( _map ) munmap( _map, _len );
+  _map = 0;
+}
+
+FilePtr Spill::file( const Header *h, bool raw ) {
+  flush();
+  FilePtr f( new File( h, 0, 0, 0, raw ) );
+  if ( f->size() != _len ) 
+    throw Exception( "zip archive corrupt (size error)" );
+  if ( _len > 0 ) {
+    // a private mapping, so the File's data may be modified in memory
+    void *p = mmap( 0, _len, PROT_READ | PROT_WRITE, MAP_PRIVATE, _fd, 0 );
+    if ( p == MAP_FAILED ) throw Exception( "can't map file" );
+    f->_data = p;
+  }
+  f->_path = _path;
+  _path = 0;
+  return f;
+}
+
+
+/**
+ *  A Rope stores data in a list of segments. Data appended to a Rope is 
+ *  never moved, new segments are allocated with increasing size when the 
+ *  last one is full. A Rope is used to store the data of files with 
+ *  unknown size. If more than _limit bytes are appended, the data is 
+ *  moved to a Spill.
+ */
+
+class Rope {
+
+  public:
+  struct Segment {
+    tByte	*data;		// allocated storage
+    int		 len;		// #bytes used
+    int		 size;		// #bytes allocated
+  };
+  std::vector<Segment>	_segments;	// list of segments
+  long			_len;		// total #bytes stored
+  Spill			*_spill;	// data exceeding _limit (or 0)
+  long			_limit;		// max. #bytes in memory (0: no limit)
+  std::string		_tmpdir;	// directory of Spills
+
+  static const long MinSegment = 64*1024, MaxSegment = 16*1024*1024;
+
+  Rope( void ) { _len = 0; _spill = 0; _limit = 0; }
+  ~Rope() { 
+    for ( auto &seg: _segments ) free( seg.data ); 
+    if ( _spill ) delete _spill;
+  }
+
+  // removes all data, the first segment is kept for reuse
+  void clear( void ) {
+    for ( size_t i = 1; i < _segments.size(); i++ ) 
+      free( _segments[i].data );
+    if ( _segments.size() > 1 ) _segments.resize( 1 );
+    if ( _segments.size() ) _segments[0].len = 0;
+    if ( _spill ) delete _spill;
+    _spill = 0;
+    _len = 0;
+  }
+
+  // moves the data to a Spill
+  void spill( void ) {
+    long len = _len;
+    std::unique_ptr<Spill> s( new Spill( _tmpdir ) );
+    for ( auto &seg: _segments ) s -> append( seg.data, seg.len );
+    clear();
+    _spill = s.release();
+    _len = len;
+  }
+
+  // calls f( data, n ) for all data stored in chunks of at most 1G
+  template <class F> void forEach( F f ) {
+    if ( !_spill ) {
+      for ( auto &seg: _segments ) f( (const tByte *) seg.data, seg.len );
+      return;
+    }
+    const tByte *p = _spill -> map();
+    try {
+      for ( long off = 0; off < _len; off += 1L << 30 )
+        f( p + off, (int) ((_len - off < (1L << 30))? _len - off : 1L << 30) );
+    }
+    catch ( ... ) { _spill -> unmap(); throw; }
+    _spill -> unmap();
+  }
+
+  // appends n bytes
+  void append( const tByte *data, int n );
+
+  // removes n bytes from the end
+  void trim( int n );
+
+}; // class Rope
+
+void Rope::append( const tByte *data, int n ) {
+  if ( !_spill && _limit && (_len + n > _limit) ) spill();
+  if ( _spill ) { _spill -> append( data, n ); _len += n; return; }
+  while ( n > 0 ) {
+    if ( _segments.empty() || (_segments.back().len == _segments.back().size) ) {
+      Segment seg;
+      long size = (_len < MinSegment)? MinSegment : 
+                  ((_len > MaxSegment)? MaxSegment : _len);
+      if ( size < n ) size = n;
+      if ( !(seg.data = (tByte *) malloc( size )) ) throw Exception();
+      seg.len = 0;
+      seg.size = (int) size;
+      _segments.push_back( seg );
+    }
+    Segment &seg = _segments.back();
+    int k = (n < seg.size - seg.len)? n : seg.size - seg.len;
+    memcpy( seg.data + seg.len, data, k );
+    seg.len += k;
+    _len += k;
+    data += k;
+    n -= k;
+} }
+
+void Rope::trim( int n ) {
+  if ( _spill ) {
+    if ( n > _len ) n = (int) _len;
+    _spill -> trim( n ); 
+    _len -= n; 
+    return; 
+  }
+  for ( size_t i = _segments.size(); (n > 0) && (i > 0); i-- ) {
+    Segment &seg = _segments[i-1];
+    int k = (n < seg.len)? n : seg.len;
+    seg.len -= k;
+    _len -= k;
+    n -= k;
+} }
 
 
 /**
  *  A Buffer is used to store data read and to scan for the signature
- *  of a zip file in a zip archive.
+ *  of a zip file in a zip archive. The Header of a file is stored in 
+ *  _buffer, if the file's size is known, _buffer is enlarged once to the 
+ *  exact size of Header and compressed data. The data of a file with 
+ *  unknown size is stored in a Rope until the DataDescriptor is found.
  */
 
 class Buffer {
@@ -157,7 +877,14 @@ class Buffer {
   tByte		*_buffer;	// allocated storage
   int		 _size;		// current buffer size
   int		 _len;		// #bytes copied to _buffer
-  tByte		*_dd;		// data descriptor if != 0
+  Rope		 _rope;		// data of file with unknown size
+  tByte		 _dd[sizeof(DataDescriptor)];	// data descriptor
+  int		 _ddlen;	// #bytes of data descriptor read
+  long		 _discarded;	// #bytes of unsized data discarded
+  long		 _reallocs;	// #reallocations of _buffer
+  long		 _moved;	// #bytes moved by reallocations
+  long		 _skipped;	// #bytes skipped (not part of a file)
+  long		 _copied;	// #bytes copied to _buffer or _rope
   int		 _flags;	// operation flags
   const tByte	*_data;		// pointer to data to read
   int		 _dlen;		// remainig #byte in data buffer
@@ -168,14 +895,20 @@ class Buffer {
   enum {
     Skiping	=	1,	// skip to signature
     Copying	=	2,	// copy until signature
+    Discarding	=	4,	// discard the data instead of copying it
     FileFound	= 	1024	// file has been successfully read
   };
 
+  enum { MinSize = 4*1024 };	// minimal size of _buffer
+
   // resets the buffer
-  void reset() { _len = 0; _flags = 0; _dd = 0; }
+  void reset() 
+    { _len = 0; _flags = 0; _ddlen = 0; _discarded = 0; _rope.clear(); }
 
   // initializes empty buffer
-  Buffer( void ) { _buffer = 0; _size = 0; reset(); }
+  Buffer( void ) 
+    { _buffer = 0; _size = 0; _reallocs = _moved = _skipped = _copied = 0; 
+      reset(); }
 
   // ~Buffer releases allocated data
   ~Buffer() { if ( _buffer ) free( _buffer ); _buffer = 0; _size = 0; reset(); }
@@ -184,10 +917,10 @@ class Buffer {
   int isHeader( void ) const { return (_len >= sizeof(Header)); }
 
   // #bytes needed to complete file
-  int needed( void ) const {
-    return ( isHeader()? ( header()->hsize() + 
+  long needed( void ) const {
+    return ( isHeader()? ( (long) header()->hsize() + 
                            ( header()->hasSize()? header()->csize() : 0 ) )
-	                 : sizeof(Header) ) - _len;
+	                 : (long) sizeof(Header) ) - _len;
   }
 
   // returns Pointer to Header
@@ -197,7 +930,7 @@ class Buffer {
   DataDescriptor *dataDescriptor( void ) const
     { return (DataDescriptor *) _dd; }
 
-  // returns Pointer to file contents
+  // returns Pointer to file contents (of a file with known size)
   tByte *contents( void ) const {
     return _buffer + header()->hsize();
   }
@@ -205,8 +938,28 @@ class Buffer {
   // returns true if zip file was found and stored
   int fileFound( void ) const { return _flags & FileFound; }
 
-  // increases buffer
-  void reserveSpace( int size = 20*1024 );
+  // discard the data of the current file (of unknown size)
+  void discard( void ) { _flags |= Discarding; }
+
+  // #bytes of data of a file with unknown size read so far
+  long unsizedLen( void ) const { return _rope._len + _discarded; }
+
+  // complete Header including file name and extra field read?
+  int isCompleteHeader( void ) const 
+    { return isHeader() && (_len >= (int) header()->hsize()); }
+
+  // returns true if no data of a file nor part of a signature is stored
+  int isIdle( void ) const 
+    { return (_len == 0) && !((_flags & Skiping) && (_slen > 0)); }
+
+  // search complete file in caller's data without copying
+  const Header *findInPlace( const tByte **data, int *len );
+
+  // enlarges _buffer to at least size bytes
+  void reserve( int size );
+
+  // scan data for the signature, return end of bytes consumed
+  const tByte *scanSignature( void );
 
   // skip until a signature has been found
   void skip ( void );
@@ -226,8 +979,11 @@ class Buffer {
   // adds data to the buffer and scans for zip file
   void addData( const char **data, int *len );
 
+  // adds data to the buffer until the complete Header has been read
+  void addHeader( const char **data, int *len );
+
   // copies bytes to the buffer
-  int copyBytes( int nbytes = -1 );
+  int copyBytes( long nbytes = -1 );
 
   // copies data of a zip file with known size
   void copySized( void );
@@ -235,37 +991,59 @@ class Buffer {
   // copies data of a zip file with unknown size
   void copyUnsized( void );
 
-  // allocated file name
-  char *heapFilename( void ) const;
+  // adds data to the DataDescriptor following deflated data
+  void addDescriptor( const char **data, int *len );
 
 }; // class Buffer
 
-void Buffer::reserveSpace( int size ) {
-  if ( size < 4 ) size += 4;
+void Buffer::reserve( int size ) {
+  if ( size <= _size ) return;
+  if ( size < MinSize ) size = MinSize;
+  tByte *b = (tByte *) realloc( _buffer, size * sizeof(tByte) );
+  if ( !b ) throw Exception();
   if ( _buffer ) {
-    if ( (_size - _len) < (size + 4) ) {
-      int dd_offset = 0;
-      if ( _dd ) dd_offset = (int)(_dd - _buffer);
-      _size = _size + size * 2;
-      _buffer = (tByte *) realloc( _buffer, _size * sizeof(tByte) );
-      if ( _dd ) _dd = _buffer + dd_offset;
-  } }
-  else _buffer = (tByte *) malloc( (_size = size + 4) * sizeof(tByte) );
-  if ( !_buffer ) throw Exception();
+    _reallocs++;
+    if ( b != _buffer ) _moved += _len;
+  }
+  _buffer = b;
+  _size = size;
+}
+
+/**
+ *  Buffer::scanSignature looks for _signature in the data to read. A signature
+ *  may straddle two calls, _slen is the #bytes of the signature found at the
+ *  end of the data read previously. A pointer to the first byte after the
+ *  signature is returned if it has been found (_slen == 4), else _data+_dlen.
+ */
+
+const tByte *Buffer::scanSignature( void ) {
+  const tByte *p = _data, *end = _data + _dlen;
+  while ( (_slen > 0) && (_slen < 4) && (p < end) ) {
+    if ( _signature[_slen] == *p ) _slen++;
+    else _slen = ( _signature[0] == *p );
+    p++;
+  }
+  if ( (_slen == 0) && (p < end) ) {
+    p = findSignature( p, end, _signature );
+    if ( end - p >= 4 ) { _slen = 4; p += 4; }
+    else { _slen = (int)(end - p); p = end; }
+  }
+  return p;
 }
 
 void Buffer::skip( void ) {
-  while ( _dlen > 0 ) {
-    if ( _signature[_slen] == *_data++ ) _slen++;
-    else _slen = 0;
-    _dlen--;
-    if ( _slen == 4 ) {
-      // signature found, copy it to _buffer
-      memcpy( _buffer + _len, _signature, 4 );
-      _len += 4;
-      _flags &= ~Skiping;
-      return;
-} } }
+  const tByte *p = scanSignature();
+  _skipped += p - _data;
+  _dlen -= (int)(p - _data);
+  _data = p;
+  if ( _slen == 4 ) {
+    // signature found, copy it to _buffer
+    memcpy( _buffer + _len, _signature, 4 );
+    _len += 4;
+    _skipped -= 4;
+    _copied += 4;
+    _flags &= ~Skiping;
+} }
 
 void Buffer::skipUntil( const tByte *signature ) {
   _signature = signature;
@@ -274,16 +1052,15 @@ void Buffer::skipUntil( const tByte *signature ) {
 }
 
 void Buffer::copy( void ) {
-  while ( _dlen > 0 ) {
-    _buffer[_len++] = *_data;
-    _dlen--;
-    if ( _signature[_slen] == *_data++ ) _slen++;
-    else _slen = 0;
-    if ( _slen == 4 ) {
-      // signature found, terminate copying
-      _flags &= ~Copying;
-      return;
-} } }
+  const tByte *p = scanSignature();
+  int n = (int)(p - _data);
+  if ( _flags & Discarding ) { _discarded += n; _skipped += n; }
+  else { _rope.append( _data, n ); _copied += n; }
+  _dlen -= n;
+  _data = p;
+  // signature found, terminate copying
+  if ( _slen == 4 ) _flags &= ~Copying;
+}
 
 void Buffer::copyUntil( const tByte *signature ) {
   _signature = signature;
@@ -292,40 +1069,63 @@ void Buffer::copyUntil( const tByte *signature ) {
 }
 
 void Buffer::scanForHeader( void ) {
-  if ( _len == 0 ) skipUntil( Header::signature );
+  if ( (_len == 0) && !(_flags & Skiping) ) skipUntil( Header::signature );
   if ( _flags & Skiping ) skip();
   if ( _dlen > 0 ) {
     int to_copy = sizeof(Header) - _len;
     if ( to_copy > _dlen ) to_copy = _dlen;
     memcpy( _buffer + _len, _data, to_copy );
     _len += to_copy;
+    _copied += to_copy;
     _data += to_copy;
     _dlen -= to_copy;
 } }
 
 void Buffer::addData( const char **buff, int *blen ) {
   if ( (*blen <= 0) || fileFound() ) return;
-  reserveSpace( *blen );
   _data = (const tByte *) *buff;
   _dlen = *blen;
-  if ( !isHeader() ) scanForHeader();
+  if ( !isHeader() ) { reserve( sizeof(Header) + 4 ); scanForHeader(); }
   if ( _dlen > 0 ) {
-    if ( header() -> hasSize() ) copySized();
-    else copyUnsized();
+    if ( header() -> hasSize() ) {
+      // the Buffer (like a File) holds less than 2 GiB
+      long size = (long) header()->hsize() + header()->csize();
+      if ( size > INT_MAX - 4 ) 
+        throw Exception( "zip archive file too large" );
+      reserve( (int) size );
+      copySized();
+    }
+    else {
+      reserve( header()->hsize() );
+      copyUnsized();
+  } }
+  *buff = (const char *) _data;
+  *blen = _dlen;
+}
+
+void Buffer::addHeader( const char **buff, int *blen ) {
+  if ( (*blen <= 0) || isCompleteHeader() ) return;
+  _data = (const tByte *) *buff;
+  _dlen = *blen;
+  if ( !isHeader() ) { reserve( sizeof(Header) + 4 ); scanForHeader(); }
+  if ( isHeader() ) {
+    reserve( header()->hsize() );
+    copyBytes( header()->hsize() - _len );
   }
   *buff = (const char *) _data;
   *blen = _dlen;
 }
 
-int Buffer::copyBytes( int need ) {
+int Buffer::copyBytes( long need ) {
   int to_copy = 0;
   if ( need < 0 ) need = needed();
   if ( need > 0 ) {
-    to_copy = (need < _dlen)? need : _dlen;
+    to_copy = (need < _dlen)? (int) need : _dlen;
     memcpy( _buffer + _len, _data, to_copy );
     _data += to_copy;
     _dlen -= to_copy;
     _len += to_copy;
+    _copied += to_copy;
   }
   return to_copy;
 }
@@ -336,37 +1136,162 @@ void Buffer::copySized( void ) {
 }
 
 void Buffer::copyUnsized( void ) {
-  if ( !_dd && !(_flags & Copying) ) copyUntil( DataDescriptor::signature );
-  if ( _flags & Copying ) copy();
-  if ( _dlen > 0 ) {
-    if( !_dd ) _dd = _buffer + _len - 4;
-    int to_copy = (int)( sizeof(DataDescriptor) - (_len - (_dd - _buffer)) );
-    if ( to_copy == copyBytes( to_copy ) ) {
+  if ( !isCompleteHeader() ) copyBytes();
+  if ( !isCompleteHeader() ) return;
+  if ( !_ddlen && !(_flags & Copying) ) copyUntil( DataDescriptor::signature );
+  if ( _flags & Copying ) {
+    copy();
+    if ( !(_flags & Copying) ) {
+      // move signature from file data to data descriptor
+      if ( _flags & Discarding ) _discarded -= 4;
+      else _rope.trim( 4 );
+      memcpy( _dd, DataDescriptor::signature, 4 );
+      _ddlen = 4;
+  } }
+  if ( _ddlen && (_dlen > 0) ) {
+    int to_copy = (int) sizeof(DataDescriptor) - _ddlen;
+    if ( to_copy > _dlen ) to_copy = _dlen;
+    memcpy( _dd + _ddlen, _data, to_copy );
+    _ddlen += to_copy;
+    _copied += to_copy;
+    _data += to_copy;
+    _dlen -= to_copy;
+    if ( _ddlen == sizeof(DataDescriptor) ) {
+      if ( dataDescriptor()->csize() != unsizedLen() ) {
+        // the signature was part of the file data, continue copying with
+        // the bytes following it (a file ending in these bytes is not 
+        // separated from the following data)
+        tByte tmp[sizeof(DataDescriptor) - 4];
+        const tByte *data = _data;
+        int dlen = _dlen;
+        memcpy( tmp, _dd + 4, sizeof tmp );
+        if ( _flags & Discarding ) _discarded += 4;
+        else _rope.append( _dd, 4 );
+        _ddlen = 0;
+        copyUntil( DataDescriptor::signature );
+        _copied -= sizeof tmp;		// copied again
+        _data = tmp;
+        _dlen = sizeof tmp;
+        copyUnsized();
+        _data = data;
+        _dlen = dlen;
+        return;
+      }
       header() -> setDataDescriptor( dataDescriptor() );
       _flags |= FileFound;
 } } }
 
-char *Buffer::heapFilename( void ) const {
-  char *ret = 0;
-  if ( isHeader() ) {
-    int l = header() -> fnlength();
-    ret = (char *) malloc( (l+1) * sizeof(char) );
-    if ( ret ) {
-      memcpy( ret, _buffer + sizeof(Header), l * sizeof(char) );
-      ret[l] = '\0';
+/**
+ *  Buffer::addDescriptor reads the DataDescriptor following the deflated 
+ *  data of a file. The signature of a DataDescriptor is optional, if it
+ *  is missing, the DataDescriptor is only 12 bytes long.
+ */
+
+void Buffer::addDescriptor( const char **buff, int *blen ) {
+  if ( (*blen <= 0) || fileFound() ) return;
+  _data = (const tByte *) *buff;
+  _dlen = *blen;
+  if ( _ddlen < 4 ) {
+    int n = ((4 - _ddlen) < _dlen)? 4 - _ddlen : _dlen;
+    memcpy( _dd + _ddlen, _data, n );
+    _ddlen += n;
+    _copied += n;
+    _data += n;
+    _dlen -= n;
+    if ( (_ddlen == 4) && memcmp( _dd, DataDescriptor::signature, 4 ) ) {
+      // no signature: these are the CRC-32 bytes
+      memcpy( _dd + 4, _dd, 4 );
+      memcpy( _dd, DataDescriptor::signature, 4 );
+      _ddlen = 8;
   } }
-  return ret;
+  if ( _ddlen >= 4 ) {
+    int n = (int) sizeof(DataDescriptor) - _ddlen;
+    if ( n > _dlen ) n = _dlen;
+    memcpy( _dd + _ddlen, _data, n );
+    _ddlen += n;
+    _copied += n;
+    _data += n;
+    _dlen -= n;
+    if ( _ddlen == sizeof(DataDescriptor) ) {
+      header() -> setDataDescriptor( dataDescriptor() );
+      _flags |= FileFound;
+  } }
+  *buff = (const char *) _data;
+  *blen = _dlen;
 }
 
-
 /**
- *  Header::toAscii writes an ascii representation of a zip Header to 
- *  the given buffer.
+ *  Buffer::findInPlace is used by an idle Buffer to look for a file which
+ *  lies completely in the caller's data. Bytes preceeding a Header signature
+ *  are skipped (*data and *len are advanced). If the Header and the 
+ *  compressed data of a file with known size are found in the remaining
+ *  data, a pointer to the Header is returned. Otherwise 0 is returned and
+ *  *data points to the Header signature (or its first bytes) to be copied.
  */
 
-int Header::toAscii( char *buff, int olen ) {
-  const char *compr = "";
-  int len = olen;
+const Header *Buffer::findInPlace( const tByte **data, int *len ) {
+  const tByte *end = *data + *len;
+  const tByte *p = findSignature( *data, end, Header::signature );
+  const Header *h = (const Header *) p;
+  if ( end - p < 4 ) {
+    // no complete signature in data: skip all data but a partial signature
+    skipUntil( Header::signature );
+    _slen = (int)(end - p);
+    p = end;
+    h = 0;
+  }
+  else if ( ((end - p) < (int) sizeof(Header)) || !h->hasSize() ||
+            ((end - p) < (long)(h->hsize() + h->csize())) )
+    h = 0;
+  _skipped += p - *data;
+  *len -= (int)(p - *data);
+  *data = p;
+  return h;
+}
+
+
+/**
+ *  Header::heapFilename returns the file name in allocated memory.
+ */
+
+char *Header::heapFilename( void ) const {
+  int l = fnlength();
+  char *ret = (char *) malloc( (l+1) * sizeof(char) );
+  if ( ret ) {
+    memcpy( ret, filename(), l * sizeof(char) );
+    ret[l] = '\0';
+  }
+  return ret;
+}
+
+
+/**
+ *  Header::modified converts the DOS modification date and time to a 
+ *  time_t.
+ */
+
+time_t Header::modified( void ) const {
+  struct tm tm;
+  memset( &tm, 0, sizeof tm );
+  tm.tm_year = (mdate() >> 9) + 80;
+  tm.tm_mon = ((mdate() >> 5) & 15) - 1;
+  tm.tm_mday = mdate() & 31;
+  tm.tm_hour = mtime() >> 11;
+  tm.tm_min = (mtime() >> 5) & 63;
+  tm.tm_sec = (mtime() & 31) * 2;
+  tm.tm_isdst = -1;
+  return mktime( &tm );
+}
+
+
+/**
+ *  Header::toAscii writes an ascii representation of a zip Header to 
+ *  the given buffer.
+ */
+
+int Header::toAscii( char *buff, int olen ) {
+  const char *compr = "";
+  int len = olen;
   switch ( compression() ) {
     case Stored:	compr = "Stored"; break;
     case Shrunk:	compr = "Shrunk"; break;
@@ -382,6 +1307,7 @@ int Header::toAscii( char *buff, int olen ) {
     case Lzma:		compr = "Lzma"; break;
     case IbmTerse:	compr = "IbmTerse"; break;
     case Lz77:		compr = "Lz77"; break;
+    case Zstd:		compr = "Zstd"; break;
     case WavPack:	compr = "WavPack"; break;
     case PPMd:		compr = "PPMd"; break;
   }
@@ -407,22 +1333,438 @@ int Header::toAscii( char *buff, int olen ) {
 
 
 /**
- *  File::inflate decompresses a file stored in a zip archive.
+ *  An Inflater holds a libz stream state which is reused for all files
+ *  decompressed (by inflateReset) instead of allocating a new state and 
+ *  window for every file. Likewise the Decoders for other compression 
+ *  methods are created once per Inflater and reset for every file.
  */
 
-void File::inflate( void *buffer ) {
-  Buffer *b = (Buffer *) buffer;
-  Header *h = b -> header();
-  int ret;
-  z_stream zs;
-  memset( &zs, 0, sizeof zs );
-  if ( inflateInit2( &zs, -MAX_WBITS ) != Z_OK )
-    throw Exception( "libz: inflateInit2 failed" );
-  zs.next_in = b->contents();
-  zs.next_out = (tByte *) _data;
-  zs.avail_in = h->csize();
-  zs.avail_out = h->size() + 4;
-  switch ( ret = ::inflate( &zs, Z_FINISH ) ) {
+class Inflater {
+
+  private:
+  z_stream	_zs;		// libz stream state
+  int		_init;		// _zs has been initialized
+  std::unordered_map<unsigned, Decoder *> _decoders; // Decoder per method
+  tByte		*_window;	// output window of streamed files
+  long		_wsize;		// #bytes allocated for _window
+
+  public:
+  Inflater( void ) { 
+    memset( &_zs, 0, sizeof _zs ); _init = 0; _window = 0; _wsize = 0; 
+  }
+  ~Inflater() { 
+    if ( _init ) inflateEnd( &_zs ); 
+    for ( auto &d: _decoders ) delete d.second;
+    if ( _window ) free( _window );
+  }
+
+  // returns an output window of at least size bytes, which is reused by 
+  // all files streamed
+  tByte *window( long size ) {
+    if ( size > _wsize ) {
+      if ( _window ) free( _window );
+      _wsize = 0;
+      if ( !(_window = (tByte *) malloc( size )) ) throw Exception();
+      _wsize = size;
+    }
+    return _window;
+  }
+
+  // returns the state prepared to inflate a new raw deflate stream
+  z_stream *begin( void ) {
+    if ( !_init ) {
+      if ( inflateInit2( &_zs, -MAX_WBITS ) != Z_OK )
+        throw Exception( "libz: inflateInit2 failed" );
+      _init = 1;
+    }
+    else if ( inflateReset( &_zs ) != Z_OK ) 
+      throw Exception( "libz: inflateReset failed" );
+    return &_zs;
+  }
+
+  // returns the Decoder for the given compression method prepared to 
+  // decode a new file
+  Decoder *decoder( unsigned method ) {
+    Decoder *&d = _decoders[method];
+    if ( !d && !(d = Decoder::create( method )) ) {
+      _decoders.erase( method );
+      throw Exception( "unsupported compression" );
+    }
+    d -> reset();
+    return d;
+  }
+
+}; // class Inflater
+
+
+#ifdef ZIP_HAVE_ZSTD
+
+/**
+ *  A ZstdDecoder decompresses Zstandard frames (method 93).
+ */
+
+class ZstdDecoder : public Decoder {
+  private:
+  ZSTD_DStream	*_ds;		// zstd stream state
+  public:
+  ZstdDecoder( void ) 
+    { if ( !(_ds = ZSTD_createDStream()) ) throw Exception(); }
+  ~ZstdDecoder() { ZSTD_freeDStream( _ds ); }
+  void reset( void ) { ZSTD_initDStream( _ds ); }
+  bool decode( const unsigned char *&in, long &inlen, unsigned char *&out, 
+               long &outlen ) {
+    ZSTD_inBuffer ib = { in, (size_t) inlen, 0 };
+    ZSTD_outBuffer ob = { out, (size_t) outlen, 0 };
+    size_t ret = ZSTD_decompressStream( _ds, &ob, &ib );
+    if ( ZSTD_isError( ret ) ) throw Exception( "zstd: corrupt data" );
+    in += ib.pos; inlen -= ib.pos;
+    out += ob.pos; outlen -= ob.pos;
+    return ret == 0;
+  }
+}; // class ZstdDecoder
+
+#endif // ZIP_HAVE_ZSTD
+
+
+#ifdef ZIP_HAVE_BZIP2
+
+/**
+ *  A Bzip2Decoder decompresses bzip2 streams (method 12).
+ */
+
+class Bzip2Decoder : public Decoder {
+  private:
+  bz_stream	_bs;		// bzip2 stream state
+  int		_init;		// _bs has been initialized
+  public:
+  Bzip2Decoder( void ) { _init = 0; }
+  ~Bzip2Decoder() { if ( _init ) BZ2_bzDecompressEnd( &_bs ); }
+  // libbz2 has no reset, so the state is recreated
+  void reset( void ) {
+    if ( _init ) BZ2_bzDecompressEnd( &_bs );
+    memset( &_bs, 0, sizeof _bs );
+    _init = 0;
+    if ( BZ2_bzDecompressInit( &_bs, 0, 0 ) != BZ_OK ) 
+      throw Exception( "bzip2: init failed" );
+    _init = 1;
+  }
+  bool decode( const unsigned char *&in, long &inlen, unsigned char *&out, 
+               long &outlen ) {
+    _bs.next_in = (char *) in;
+    _bs.avail_in = (unsigned) inlen;
+    _bs.next_out = (char *) out;
+    _bs.avail_out = (unsigned) outlen;
+    int ret = BZ2_bzDecompress( &_bs );
+    if ( (ret != BZ_OK) && (ret != BZ_STREAM_END) ) 
+      throw Exception( "bzip2: corrupt data" );
+    in = (const unsigned char *) _bs.next_in; inlen = _bs.avail_in;
+    out = (unsigned char *) _bs.next_out; outlen = _bs.avail_out;
+    return ret == BZ_STREAM_END;
+  }
+}; // class Bzip2Decoder
+
+#endif // ZIP_HAVE_BZIP2
+
+
+#ifdef ZIP_HAVE_LZMA
+
+/**
+ *  An LzmaDecoder decompresses LZMA data (method 14). In zip archives the
+ *  raw LZMA stream is preceeded by a version (2 bytes), the size of the
+ *  properties (2 bytes) and the properties (5 bytes). The end of stream 
+ *  marker is optional, without it the file ends after size() bytes.
+ */
+
+class LzmaDecoder : public Decoder {
+  private:
+  enum { PropsSize = 9 };
+  lzma_stream	_ls;		// lzma stream state
+  int		_init;		// _ls has been initialized
+  tByte		_props[PropsSize]; // zip LZMA properties header
+  int		_plen;		// #bytes in _props (> PropsSize: started)
+  void start( void );
+  public:
+  LzmaDecoder( void ) 
+    { lzma_stream ls = LZMA_STREAM_INIT; _ls = ls; _init = 0; }
+  ~LzmaDecoder() { if ( _init ) lzma_end( &_ls ); }
+  void reset( void ) { _plen = 0; }
+  bool decode( const unsigned char *&in, long &inlen, unsigned char *&out, 
+               long &outlen );
+}; // class LzmaDecoder
+
+void LzmaDecoder::start( void ) {
+  lzma_options_lzma opts;
+  lzma_filter filters[2];
+  unsigned d = _props[4];
+  if ( (_props[2] | (_props[3] << 8)) != 5 || (d >= 9*5*5) ) 
+    throw Exception( "lzma: invalid properties" );
+  memset( &opts, 0, sizeof opts );
+  opts.lc = d % 9; d /= 9;
+  opts.lp = d % 5;
+  opts.pb = d / 5;
+  opts.dict_size = _props[5] | (_props[6] << 8) | (_props[7] << 16) | 
+                   ((unsigned) _props[8] << 24);
+  filters[0].id = LZMA_FILTER_LZMA1;
+  filters[0].options = &opts;
+  filters[1].id = LZMA_VLI_UNKNOWN;
+  filters[1].options = 0;
+  // lzma_raw_decoder reuses the memory of an initialized stream
+  if ( lzma_raw_decoder( &_ls, filters ) != LZMA_OK )
+    throw Exception( "lzma: init failed" );
+  _init = 1;
+  _plen++;
+}
+
+bool LzmaDecoder::decode( const unsigned char *&in, long &inlen, 
+                          unsigned char *&out, long &outlen ) {
+  while ( (_plen < PropsSize) && (inlen > 0) ) 
+    { _props[_plen++] = *in++; inlen--; }
+  if ( _plen < PropsSize ) return false;
+  if ( _plen == PropsSize ) start();
+  _ls.next_in = in;
+  _ls.avail_in = inlen;
+  _ls.next_out = out;
+  _ls.avail_out = outlen;
+  lzma_ret ret = lzma_code( &_ls, LZMA_RUN );
+  if ( (ret != LZMA_OK) && (ret != LZMA_STREAM_END) && (ret != LZMA_BUF_ERROR) )
+    throw Exception( "lzma: corrupt data" );
+  in = _ls.next_in; inlen = _ls.avail_in;
+  out = _ls.next_out; outlen = _ls.avail_out;
+  return ret == LZMA_STREAM_END;
+}
+
+#endif // ZIP_HAVE_LZMA
+
+
+/**
+ *  decoderRegistry returns the map of Decoder factories by compression 
+ *  method, initially holding the built in Decoders.
+ */
+
+typedef std::unordered_map<unsigned, Decoder::Factory> DecoderRegistry;
+static std::mutex decoderMutex;
+
+static DecoderRegistry &decoderRegistry( void ) {
+  static DecoderRegistry registry = {
+#ifdef ZIP_HAVE_ZSTD
+    { Header::Zstd, []() -> Decoder * { return new ZstdDecoder; } },
+#endif
+#ifdef ZIP_HAVE_BZIP2
+    { Header::Bzip2, []() -> Decoder * { return new Bzip2Decoder; } },
+#endif
+#ifdef ZIP_HAVE_LZMA
+    { Header::Lzma, []() -> Decoder * { return new LzmaDecoder; } },
+#endif
+  };
+  return registry;
+}
+
+
+/**
+ *  Decoder::add registers a Decoder factory for a compression method 
+ *  (replacing a previously registered one). Stored and Deflated files are
+ *  always handled internally.
+ */
+
+void Decoder::add( unsigned method, Factory factory ) {
+  std::lock_guard<std::mutex> lock( decoderMutex );
+  if ( factory ) decoderRegistry()[method] = factory;
+  else decoderRegistry().erase( method );
+}
+
+
+/**
+ *  Decoder::create creates a Decoder for the given compression method, 0
+ *  is returned if no Decoder is registered for method.
+ */
+
+Decoder *Decoder::create( unsigned method ) {
+  Factory factory = 0;
+  {
+    std::lock_guard<std::mutex> lock( decoderMutex );
+    auto it = decoderRegistry().find( method );
+    if ( it != decoderRegistry().end() ) factory = it->second;
+  }
+  return factory? factory() : 0;
+}
+
+
+/**
+ *  decodeCrc decodes the input [in, in+inlen) to out (outlen bytes 
+ *  available) in windows of CrcWindow bytes and updates *crc with every 
+ *  window (like inflateCrc). The pointers and lengths are advanced, true
+ *  is returned at the end of the compressed data.
+ */
+
+static bool decodeCrc( Decoder *dec, const tByte *&in, long &inlen, 
+                       tByte *&out, long &outlen, unsigned long *crc ) {
+  bool end = false;
+  while ( !end ) {
+    tByte *o = out;
+    const tByte *i = in;
+    long window = (outlen < CrcWindow)? outlen : CrcWindow, avail = window;
+    end = dec -> decode( in, inlen, o, avail );
+    long produced = window - avail;
+    *crc = crc32Update( *crc, out, produced );
+    out += produced;
+    outlen -= produced;
+    // no progress due to missing input or output space
+    if ( (produced == 0) && (in == i) ) break;
+  }
+  return end;
+}
+
+
+class Arena;
+
+/**
+ *  A Pool keeps the buffers of deleted Files for reuse. Buffers are kept 
+ *  in size classes of powers of 2 between MinSize and MaxSize, larger 
+ *  buffers are simply allocated and freed. A Pool is shared by a Stream 
+ *  and the Files it created and is deleted when the last of them is gone.
+ *  Files may be deleted in any thread. In arena mode _arena is the 
+ *  Stream's current Arena, which takes its slabs from the Pool.
+ */
+
+class Pool {
+
+  private:
+  enum { MinShift = 12, MaxShift = 24, NClasses = MaxShift - MinShift + 1,
+         MaxFree = 8 };
+  std::vector<void *>	_free[NClasses];	// free buffers per size class
+  std::mutex		_mutex;			// protects _free
+  std::atomic<int>	_refs;			// #references
+
+  // size class of the given #bytes (-1: too large)
+  static int sizeClass( long size ) {
+    int c = 0;
+    while ( (c < NClasses) && ((1L << (c + MinShift)) < size) ) c++;
+    return (c < NClasses)? c : -1;
+  }
+
+  ~Pool() { for ( auto &v: _free ) for ( void *p: v ) free( p ); }
+
+  public:
+  Arena			*_arena;		// current Arena (or 0)
+
+  Pool( void ) : _refs( 1 ) { _arena = 0; }
+
+  void retain( void ) { _refs++; }
+  void release( void ) { if ( --_refs == 0 ) delete this; }
+
+  // size of the buffer get returns for size bytes
+  static long capacity( long size ) {
+    int c = sizeClass( size );
+    return (c < 0)? size : (1L << (c + MinShift));
+  }
+
+  // returns a buffer of at least size bytes
+  void *get( long size ) {
+    int c = sizeClass( size );
+    if ( c < 0 ) return malloc( size );
+    {
+      std::lock_guard<std::mutex> lock( _mutex );
+      if ( !_free[c].empty() ) {
+        void *p = _free[c].back();
+        _free[c].pop_back();
+        return p;
+    } }
+    return malloc( 1L << (c + MinShift) );
+  }
+
+  // returns a buffer of size bytes gotten from get to the pool
+  void put( void *ptr, long size ) {
+    int c = sizeClass( size );
+    if ( c >= 0 ) {
+      std::lock_guard<std::mutex> lock( _mutex );
+      if ( _free[c].size() < MaxFree ) { _free[c].push_back( ptr ); return; }
+    }
+    free( ptr );
+  }
+
+}; // class Pool
+
+
+/**
+ *  An Arena is a generation of slabs the buffers (Header and data) and 
+ *  names of Files are allocated from by bumping a pointer. Every File 
+ *  allocated holds a reference as does the Stream while the Arena is its
+ *  current one. The slabs are returned to the Pool as soon as the 
+ *  last reference is gone. Only the Stream's thread allocates, Files may 
+ *  be deleted in any thread. Requests larger than a quarter of a slab get
+ *  a slab of their own.
+ */
+
+class Arena {
+
+  private:
+  Pool			*_pool;		// Pool slabs are taken from
+  std::vector<std::pair<tByte *, long>> _slabs;	// slabs and their sizes
+  tByte			*_next;		// next free byte in current slab
+  long			 _left;		// #bytes left in current slab
+  long			 _used;		// #bytes of slabs allocated
+  std::atomic<int>	 _refs;		// #references
+
+  ~Arena() {
+    for ( auto &s: _slabs ) _pool -> put( s.first, s.second );
+    _pool -> release();
+  }
+
+  // allocates a slab of the given size
+  tByte *slab( long size ) {
+    tByte *ret = (tByte *) _pool -> get( size );
+    if ( !ret ) throw Exception();
+    _slabs.push_back( std::make_pair( ret, size ) );
+    _used += size;
+    return ret;
+  }
+
+  public:
+  enum { SlabSize = 1024*1024, MaxUsed = 64*1024*1024, Align = 16 };
+
+  Arena( Pool *pool ) : _refs( 1 ) {
+    _pool = pool; _next = 0; _left = _used = 0;
+    pool -> retain();
+  }
+
+  void retain( void ) { _refs++; }
+  void release( void ) { if ( --_refs == 0 ) delete this; }
+
+  // returns size bytes aligned to Align
+  void *alloc( long size ) {
+    size = (size + Align - 1) & ~(long) (Align - 1);
+    if ( size > _left ) {
+      if ( size > SlabSize / 4 ) return slab( size );
+      _next = slab( SlabSize );
+      _left = SlabSize;
+    }
+    void *ret = _next;
+    _next += size;
+    _left -= size;
+    return ret;
+  }
+
+  // returns the Arena to allocate from of a Stream's Pool (0: none), a 
+  // new generation is started when the current one has used MaxUsed bytes
+  static Arena *of( Pool *pool ) {
+    Arena *a = pool? pool->_arena : 0;
+    if ( a && (a->_used >= MaxUsed) ) {
+      pool->_arena = new Arena( pool );
+      a -> release();
+      a = pool->_arena;
+    }
+    return a;
+  }
+
+}; // class Arena
+
+
+/**
+ *  inflateError throws the Exception matching a libz error code.
+ */
+
+static void inflateError( int ret ) {
+  switch ( ret ) {
     case Z_OK :
       throw Exception( "libz: incomplete deflated stream" );
     case Z_NEED_DICT :
@@ -435,14 +1777,6 @@ void File::inflate( void *buffer ) {
       throw Exception( "libz: not enough space for inflate output" );
     case Z_STREAM_ERROR :
       throw Exception( "libz: argument error" );
-    case Z_STREAM_END : {
-      inflateEnd( &zs );
-      // handle CRC32
-      unsigned long crc = crc32( 0L, (tByte *) _data, h->size() );
-      if ( crc != h->crc32() )
-	throw Exception( "zip archive corrupt (CRC32 error)" );
-      break;
-    }
     default:
       debug( "inflate: %d\n", ret );
       throw Exception( "libz: unknown inflate error" );
@@ -450,105 +1784,3442 @@ void File::inflate( void *buffer ) {
 
 
 /**
- *  File::File takes a Buffer* (opaque) and uses libz-functions to 
- *  decompress the file in the Buffer-object.
+ *  inflateCrc decompresses the input given in zs to zs->next_out in 
+ *  windows of CrcWindow bytes and updates *crc with every window while 
+ *  it is still in cache. The return value is Z_OK if more input is 
+ *  needed or the libz error (Z_STREAM_END at the end of the stream).
  */
 
-File::File( void *buffer ) {
-  Buffer *b = (Buffer *) buffer;
-  Header *h = b -> header();
-  int datasize = h->hsize() + h->size() + 4;
-  if ( !(_header = malloc( datasize )) ) throw Exception();
-  memcpy( _header, h, h->hsize() );
-  _name = b->heapFilename();
-  if ( h->size() > 0 ) {
-    // decompress file contents
-    _data = ((tByte*) _header) + h->hsize();
-    switch ( h->compression() ) {
-      case Header::Stored : memcpy( _data, b->contents(), h->size() ); break;
-      case Header::Deflated : inflate( buffer ); break;
-      default: throw Exception( "unsupported compression" );
-    }
+static int inflateCrc( z_stream *zs, unsigned long *crc ) {
+  int ret = Z_OK;
+  while ( ret == Z_OK ) {
+    tByte *out = zs->next_out;
+    uInt avail = zs->avail_out;
+    uInt window = (avail < CrcWindow)? avail : CrcWindow;
+    zs->avail_out = window;
+    ret = ::inflate( zs, Z_NO_FLUSH );
+    uInt produced = window - zs->avail_out;
+    *crc = crc32Update( *crc, out, produced );
+    zs->avail_out = avail - produced;
+    if ( (ret == Z_OK) && (zs->avail_in == 0) && (produced < window) ) break;
   }
-  else _data = 0;
+  // no progress due to missing input
+  if ( (ret == Z_BUF_ERROR) && (zs->avail_out > 0) ) ret = Z_OK;
+  return ret;
 }
 
 
 /**
- *  The File::~File destructor releases all allocated data.
+ *  The following implements a one-shot inflate for files of known size.
+ *  As the complete input and output are in memory, no state machine is
+ *  needed: blocks are decoded in a tight loop using a 64 bit bit buffer 
+ *  (refilled with one unaligned load) and two level Huffman tables 
+ *  decoding a complete literal/length or distance code per lookup.
+ *  Matches are copied 8 bytes at a time where possible. Anything
+ *  unexpected (corrupt data, output overflow) makes fastInflate fail,
+ *  the file is then decompressed by libz which reports the error.
  */
 
-File::~File() {
-  if ( _header ) free( _header );
-  if ( _name ) free( _name );
-  _header = _data = 0;
-  _name = 0;
+// A Code is an entry of a Huffman decoding table. op is 0 for a literal
+// (val), 0x10|n for a base value val followed by n extra bits, 0x20 for the
+// end of block, 0x40|n for a link to a sub table at val indexed by n 
+// further bits and 0x60 for an invalid code. bits is the code length (in
+// sub tables the length beyond the primary table's bits).
+struct Code { unsigned char op, bits; unsigned short val; };
+
+enum { 
+  LenRoot = 10, DistRoot = 8, ClenRoot = 7,	// bits of primary tables
+  LenTableSize = 1332, DistTableSize = 402,	// see libz's enough.c
+  ClenTableSize = 1 << ClenRoot,
+  CodeLens = 0, CodeLits = 1, CodeDists = 2	// table types
+};
+
+static const unsigned short lenBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 
+  67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const unsigned char lenExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 
+  5, 5, 5, 5, 0 };
+static const unsigned short distBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+  769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const unsigned char distExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+  11, 11, 12, 12, 13, 13 };
+static const unsigned char clenOrder[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// returns the table entry for symbol sym of a table of the given type
+static Code symbolCode( int type, unsigned sym ) {
+  Code c = { 0x60, 0, 0 };
+  if ( type == CodeLens ) { c.op = 0; c.val = sym; }
+  else if ( type == CodeLits ) {
+    if ( sym < 256 ) { c.op = 0; c.val = sym; }
+    else if ( sym == 256 ) c.op = 0x20;
+    else if ( sym < 286 ) 
+      { c.op = 0x10 | lenExtra[sym-257]; c.val = lenBase[sym-257]; }
+  }
+  else if ( sym < 30 ) { c.op = 0x10 | distExtra[sym]; c.val = distBase[sym]; }
+  return c;
 }
 
+// reverses the len low bits of code
+static unsigned reverseBits( unsigned code, int len ) {
+  unsigned r = 0;
+  while ( len-- > 0 ) { r = (r << 1) | (code & 1); code >>= 1; }
+  return r;
+}
 
 /**
- *  File::size returns the file's size (uncompressed).
+ *  buildTable builds a decoding table for the n code lengths lens with a
+ *  primary table of 2^root entries followed by sub tables for the longer
+ *  codes (the table must have room for size entries). Like libz, 
+ *  incomplete codes are only accepted if consisting of a single code.
  */
 
-int File::size( void ) const {
-  return ((Header *)_header) -> size();
+static bool buildTable( Code *table, int size, const unsigned char *lens, 
+                        int n, int root, int type ) {
+  unsigned short count[16], offs[16], sorted[320];
+  unsigned char groupMax[1 << LenRoot];
+  int len, max, left, k;
+  memset( count, 0, sizeof count );
+  for ( int i = 0; i < n; i++ ) count[lens[i]]++;
+  count[0] = 0;
+  for ( max = 15; (max > 0) && !count[max]; max-- );
+  for ( left = 1, len = 1; len <= 15; len++ ) 
+    if ( (left = (left << 1) - count[len]) < 0 ) return false;
+  if ( (left > 0) && ((type == CodeLens) || (max > 1)) ) return false;
+  offs[1] = 0;
+  for ( len = 1; len < 15; len++ ) offs[len+1] = offs[len] + count[len];
+  for ( int i = 0; i < n; i++ ) if ( lens[i] ) sorted[offs[lens[i]]++] = i;
+  Code invalid = { 0x60, 1, 0 };
+  for ( int i = 0; i < (1 << root); i++ ) table[i] = invalid;
+  // canonical codes are assigned in order of (length, symbol), the codes
+  // sharing the first root bits (a sub table) are adjacent
+  unsigned mask = (1u << root) - 1, code = 0;
+  if ( max > root ) {
+    memset( groupMax, 0, 1u << root );
+    for ( code = 0, k = 0, len = 1; len <= max; len++, code <<= 1 )
+      for ( int c = 0; c < count[len]; c++, k++, code++ )
+        if ( len > root ) groupMax[reverseBits( code, len ) & mask] = len;
+  }
+  int used = 1 << root, subBase = 0, subBits = 0;
+  unsigned prefix = ~0u;
+  for ( code = 0, k = 0, len = 1; len <= max; len++, code <<= 1 ) {
+    for ( int c = 0; c < count[len]; c++, k++, code++ ) {
+      Code e = symbolCode( type, sorted[k] );
+      unsigned rev = reverseBits( code, len );
+      if ( len <= root ) {
+        e.bits = len;
+        for ( unsigned i = rev; i <= mask; i += 1u << len ) table[i] = e;
+        continue;
+      }
+      if ( (rev & mask) != prefix ) {
+        prefix = rev & mask;
+        subBits = groupMax[prefix] - root;
+        if ( used + (1 << subBits) > size ) return false;
+        subBase = used;
+        used += 1 << subBits;
+        for ( int i = 0; i < (1 << subBits); i++ ) table[subBase+i] = invalid;
+        table[prefix].op = 0x40 | subBits;
+        table[prefix].bits = root;
+        table[prefix].val = subBase;
+      }
+      e.bits = len - root;
+      for ( unsigned i = rev >> root; i < (1u << subBits); 
+            i += 1u << (len - root) ) 
+        table[subBase+i] = e;
+  } }
+  return true;
+}
+
+/**
+ *  FixedTables holds the tables of the fixed Huffman codes (built once).
+ */
+
+struct FixedTables {
+  Code lits[LenTableSize], dists[DistTableSize];
+  FixedTables( void ) {
+    unsigned char lens[288];
+    memset( lens, 8, 144 );
+    memset( lens + 144, 9, 112 );
+    memset( lens + 256, 7, 24 );
+    memset( lens + 280, 8, 8 );
+    buildTable( lits, LenTableSize, lens, 288, LenRoot, CodeLits );
+    memset( lens, 5, 32 );
+    buildTable( dists, DistTableSize, lens, 32, DistRoot, CodeDists );
+  }
+};
+
+/**
+ *  A BitReader reads the compressed data LSB first. Near the end of the 
+ *  input zero bytes are read beyond the end, this is checked by overrun.
+ */
+
+struct BitReader {
+  const tByte	*in, *end;	// next input byte, end of input
+  uint64_t	 buf;		// bit buffer
+  unsigned	 cnt;		// #bits in buf
+
+  // fills buf with at least 56 bits
+  inline void refill( void ) {
+    if ( end - in >= 8 ) {
+      uint64_t w;
+      memcpy( &w, in, 8 );
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+      w = __builtin_bswap64( w );
+#endif
+      buf |= w << cnt;
+      in += (63 - cnt) >> 3;
+      cnt |= 56;
+    }
+    else while ( cnt <= 56 ) {
+      if ( in < end ) buf |= (uint64_t) *in << cnt;
+      in++;
+      cnt += 8;
+  } }
+  inline unsigned peek( unsigned n ) const 
+    { return (unsigned) buf & ((1u << n) - 1); }
+  inline void drop( unsigned n ) { buf >>= n; cnt -= n; }
+  inline unsigned bits( unsigned n ) 
+    { unsigned v = peek( n ); drop( n ); return v; }
+  // more bytes consumed than available?
+  bool overrun( void ) const { return in - (cnt >> 3) > end; }
+};
+
+/**
+ *  readDynamicTables reads the code lengths of a dynamic Huffman block 
+ *  and builds its tables.
+ */
+
+static bool readDynamicTables( BitReader &br, Code *lits, Code *dists ) {
+  unsigned char lens[320];
+  Code clens[ClenTableSize];
+  br.refill();
+  unsigned nlits = br.bits( 5 ) + 257, ndists = br.bits( 5 ) + 1, 
+           nclens = br.bits( 4 ) + 4;
+  if ( (nlits > 286) || (ndists > 30) ) return false;
+  memset( lens, 0, 19 );
+  for ( unsigned i = 0; i < nclens; i++ ) {
+    br.refill();
+    lens[clenOrder[i]] = br.bits( 3 );
+  }
+  if ( !buildTable( clens, ClenTableSize, lens, 19, ClenRoot, CodeLens ) )
+    return false;
+  unsigned n = nlits + ndists, i = 0;
+  while ( i < n ) {
+    br.refill();
+    Code e = clens[br.peek( ClenRoot )];
+    if ( e.op ) return false;
+    br.drop( e.bits );
+    unsigned rep, val = 0;
+    if ( e.val < 16 ) { lens[i++] = e.val; continue; }
+    if ( e.val == 16 ) {
+      if ( i == 0 ) return false;
+      val = lens[i-1];
+      rep = 3 + br.bits( 2 );
+    }
+    else if ( e.val == 17 ) rep = 3 + br.bits( 3 );
+    else rep = 11 + br.bits( 7 );
+    if ( i + rep > n ) return false;
+    while ( rep-- ) lens[i++] = val;
+  }
+  if ( lens[256] == 0 ) return false;
+  return buildTable( lits, LenTableSize, lens, nlits, LenRoot, CodeLits ) &&
+    buildTable( dists, DistTableSize, lens + nlits, ndists, DistRoot, 
+                CodeDists );
+}
+
+/**
+ *  fastInflate decompresses the raw deflate stream [in, in+inlen) to out
+ *  which has room for outlen bytes and must receive exactly size bytes.
+ *  The CRC-32 of the output is computed in windows of CrcWindow bytes
+ *  while the data is still in cache. false is returned if the data can't 
+ *  be decompressed this way.
+ */
+
+static bool fastInflate( const tByte *in, long inlen, tByte *out, 
+                         long outlen, long size, unsigned long *crc ) {
+  static const FixedTables fixed;
+  Code dynamic[LenTableSize + DistTableSize];
+  BitReader br = { in, in + inlen, 0, 0 };
+  tByte *op = out, *oend = out + outlen, *crcp = out;
+  unsigned long c = 0;
+  int final;
+  do {
+    br.refill();
+    final = br.bits( 1 );
+    int type = br.bits( 2 );
+    if ( type == 0 ) {
+      // stored block, the bit buffer is given back to the input
+      br.drop( br.cnt & 7 );
+      br.in -= br.cnt >> 3;
+      br.buf = 0;
+      br.cnt = 0;
+      if ( (br.in > br.end) || (br.end - br.in < 4) ) return false;
+      unsigned len = br.in[0] | (br.in[1] << 8);
+      if ( (len ^ (br.in[2] | (br.in[3] << 8))) != 0xffff ) return false;
+      br.in += 4;
+      if ( (br.end - br.in < len) || (oend - op < len) ) return false;
+      memcpy( op, br.in, len );
+      op += len;
+      br.in += len;
+    }
+    else if ( type == 3 ) return false;
+    else {
+      const Code *lits = fixed.lits, *dists = fixed.dists;
+      if ( type == 2 ) {
+        lits = dynamic;
+        dists = lits + LenTableSize;
+        if ( !readDynamicTables( br, (Code *) lits, (Code *) dists ) ) 
+          return false;
+      }
+      for (;;) {
+        if ( op - crcp >= CrcWindow ) {
+          c = crc32Update( c, crcp, op - crcp );
+          crcp = op;
+        }
+        // at most 15+5 bits for a length and 15+13 bits for a distance
+        br.refill();
+        Code e = lits[br.peek( LenRoot )];
+        if ( e.op & 0x40 ) {
+          if ( e.op & 0x20 ) return false;
+          br.drop( e.bits );
+          e = lits[e.val + br.peek( e.op & 15 )];
+          if ( e.op & 0x40 ) return false;
+        }
+        br.drop( e.bits );
+        if ( e.op == 0 ) {
+          if ( op >= oend ) return false;
+          *op++ = (tByte) e.val;
+          continue;
+        }
+        if ( e.op & 0x20 ) break;
+        unsigned len = e.val + br.bits( e.op & 15 );
+        Code d = dists[br.peek( DistRoot )];
+        if ( d.op & 0x40 ) {
+          if ( d.op & 0x20 ) return false;
+          br.drop( d.bits );
+          d = dists[d.val + br.peek( d.op & 15 )];
+        }
+        if ( !(d.op & 0x10) ) return false;
+        br.drop( d.bits );
+        unsigned dist = d.val + br.bits( d.op & 15 );
+        if ( (dist > op - out) || (len > oend - op) ) return false;
+        const tByte *src = op - dist;
+        if ( (dist >= 8) && (oend - op >= len + 8) ) {
+          tByte *end = op + len;
+          do { memcpy( op, src, 8 ); op += 8; src += 8; } while ( op < end );
+          op = end;
+        }
+        else if ( dist == 1 ) { memset( op, *src, len ); op += len; }
+        else while ( len-- ) *op++ = *src++;
+    } }
+    if ( br.overrun() ) return false;
+  } while ( !final );
+  if ( op - out != size ) return false;
+  *crc = crc32Update( c, crcp, op - crcp );
+  return true;
+}
+
+
+bool inflateKnownSize( const void *in, long inlen, void *out, long size,
+                       unsigned long *crc ) {
+  return fastInflate( (const tByte *) in, inlen, (tByte *) out, size, size, 
+                      crc );
 }
 
 
 /**
- *  The default implementation of StreamDelegate::handleFile prints the file 
- *  name and some header data to stdout.
+ *  File::inflate decompresses a file stored in a zip archive. As the
+ *  sizes are known, fastInflate is tried first, libz is used if it fails.
  */
 
-void StreamDelegate::handleFile( File *file ) {
-  char buff[1024];
-  Header *h = (Header*)(file->header());
-  h -> toAscii( buff, 1024 );
-  printf( "%s: %s\n", file->name(), buff );
-  fflush( stdout );
+void File::inflate( const void *contents, void *inflater ) {
+  Header *h = (Header *) _header;
+  unsigned long crc = 0;
+  if ( fastInflate( (const tByte *) contents, h->csize(), (tByte *) _data,
+                    h->size() + 4, h->size(), &crc ) ) {
+    if ( crc != h->crc32() )
+      throw Exception( "zip archive corrupt (CRC32 error)" );
+    return;
+  }
+  crc = 0;
+  Inflater tmp;
+  z_stream *zs = ( inflater? (Inflater *) inflater : &tmp ) -> begin();
+  zs->next_in = (tByte *) contents;
+  zs->next_out = (tByte *) _data;
+  zs->avail_in = h->csize();
+  zs->avail_out = h->size() + 4;
+  int ret = inflateCrc( zs, &crc );
+  if ( ret != Z_STREAM_END ) inflateError( ret );
+  // handle CRC32
+  if ( crc != h->crc32() )
+    throw Exception( "zip archive corrupt (CRC32 error)" );
 }
 
 
 /**
- *  The Stream constructor allocates a Buffer object to store the read data 
+ *  File::decode decompresses a file using the Decoder registered for its
+ *  compression method.
  */
 
-Stream::Stream( StreamDelegate &delegate ) {
-  _delegate = &delegate;
-  _buffer = new Buffer;
-  _bytes_read = 0;
+void File::decode( const void *contents, void *inflater ) {
+  Header *h = (Header *) _header;
+  Inflater tmp;
+  Decoder *dec = 
+    (inflater? (Inflater *) inflater : &tmp) -> decoder( h->compression() );
+  unsigned long crc = 0;
+  const tByte *in = (const tByte *) contents;
+  long inlen = h->csize();
+  tByte *out = (tByte *) _data;
+  long outlen = h->size() + 4;
+  decodeCrc( dec, in, inlen, out, outlen, &crc );
+  // without end marker (e.g. LZMA) the file ends after size() bytes
+  if ( out - (tByte *) _data != h->size() ) 
+    throw Exception( "zip archive corrupt (size error)" );
+  if ( crc != h->crc32() )
+    throw Exception( "zip archive corrupt (CRC32 error)" );
 }
 
 
 /**
- *  The Stream destructor releases all allocated structures.
+ *  File::File takes a Buffer* (opaque) and uses libz-functions to 
+ *  decompress the file in the Buffer-object.
  */
 
-Stream::~Stream() {
-  Buffer *b = (Buffer *) _buffer;
-  _delegate = 0;
-  if ( b ) delete b;
-  _buffer = 0;
+File::File( void *buffer ) {
+  _raw = 0;
+  init( buffer, 0, 0 );
 }
 
 
 /**
- *  Stream::scan scans the given data for a zip file in a zip archive. If
- *  a complete file could be found, the File is passed to the StreamDelegate.
+ *  This File::init takes the file from a Buffer, the compressed data of a 
+ *  file with unknown size is read from the Buffer's Rope.
  */
 
-void Stream::scan( const char *buff, int blen ) {
-  Buffer *b = (Buffer *) _buffer;
-  int bufflen = blen;
-  while ( bufflen > 0 ) {
-    b->addData( &buff, &bufflen );
-    _bytes_read += (blen - bufflen);
-    blen = bufflen;
-    if ( b->fileFound() ) {
-      File *f = new File( b );
-      _delegate -> handleFile( f );
-      b->reset();
-} } }
+void File::init( void *buffer, void *inflater, void *pool ) {
+  Buffer *b = (Buffer *) buffer;
+  Header *h = b -> header();
+  if ( h->hasSize() ) { init( h, b->contents(), inflater, pool ); return; }
+  alloc( h, 1, pool );
+  if ( h->size() > 0 ) {
+    _data = ((tByte*) _header) + h->hsize();
+    Rope &r = b->_rope;
+    unsigned long crc = 0;
+    try {
+      switch ( h->compression() ) {
+        case Header::Stored : {
+          tByte *p = (tByte *) _data;
+          if ( r._len != h->size() )
+            throw Exception( "zip archive corrupt (size error)" );
+          r.forEach( [&]( const tByte *data, int len ) {
+            crc = copyCrc( p, data, len, crc );
+            p += len; 
+          });
+          break;
+        }
+        case Header::Deflated : {
+          Inflater tmp;
+          z_stream *zs = (inflater? (Inflater *) inflater : &tmp) -> begin();
+          int ret = Z_OK;
+          zs->next_out = (tByte *) _data;
+          zs->avail_out = h->size() + 4;
+          r.forEach( [&]( const tByte *data, int len ) {
+            if ( ret != Z_OK ) return;
+            zs->next_in = (tByte *) data;
+            zs->avail_in = len;
+            ret = inflateCrc( zs, &crc );
+          });
+          if ( ret != Z_STREAM_END ) inflateError( ret );
+          break;
+        }
+        default: {
+          Inflater tmp;
+          Decoder *dec = 
+            (inflater? (Inflater *) inflater : &tmp) -> decoder( 
+            h->compression() );
+          tByte *out = (tByte *) _data;
+          long outlen = h->size() + 4;
+          bool end = false;
+          r.forEach( [&]( const tByte *data, int len ) {
+            const tByte *in = data;
+            long inlen = len;
+            if ( !end ) end = decodeCrc( dec, in, inlen, out, outlen, &crc );
+          });
+          if ( out - (tByte *) _data != h->size() ) 
+            throw Exception( "zip archive corrupt (size error)" );
+          break;
+        }
+      }
+      if ( crc != h->crc32() )
+        throw Exception( "zip archive corrupt (CRC32 error)" );
+    }
+    catch ( ... ) { clear(); throw; }
+  }
+  else _data = 0;
+}
+
+
+/**
+ *  This File constructor takes a Header and the compressed file contents
+ *  directly from memory (e.g. a caller's buffer given to Stream::scan).
+ *  If contents is 0, only the Header is copied (data() returns 0), this is
+ *  used for the Files passed to the StreamDelegate in streaming mode.
+ *  An opaque Inflater and Pool may be passed to reuse libz state and
+ *  buffers. If raw is true, the compressed contents is copied as is.
+ */
+
+File::File( const void *header, const void *contents, void *inflater,
+            void *pool, bool raw ) {
+  _raw = raw;
+  init( header, contents, inflater, pool );
+}
+
+
+/**
+ *  File::alloc allocates the File's buffer (from the given Pool if != 0)
+ *  for the Header and the uncompressed data (if withData) and copies the
+ *  Header and the file name. If the Pool has an Arena, the buffer and name
+ *  are allocated there.
+ */
+
+void File::alloc( const void *header, int withData, void *pool ) {
+  const Header *h = (const Header *) header;
+  long datasize = 
+    h->hsize() + (withData? (_raw? h->csize() : h->size()) + 4 : 0);
+  Arena *arena = Arena::of( (Pool *) pool );
+  _name = 0;
+  _data = 0;
+  _path = 0;
+  _arena = 0;
+  if ( arena ) {
+    int l = h->fnlength();
+    _pool = 0;
+    _header = arena -> alloc( datasize );
+    _name = (char *) arena -> alloc( l + 1 );
+    memcpy( _name, h->filename(), l );
+    _name[l] = '\0';
+    arena -> retain();
+    _arena = arena;
+  }
+  else {
+    _pool = pool;
+    _header = pool? ((Pool *) pool) -> get( datasize ) : malloc( datasize );
+    if ( !_header ) throw Exception();
+    if ( pool ) ((Pool *) pool) -> retain();
+    _name = h->heapFilename();
+  }
+  memcpy( _header, h, h->hsize() );
+}
+
+
+/**
+ *  File::init copies the Header and decompresses the file contents.
+ */
+
+void File::init( const void *header, const void *contents, void *inflater,
+                 void *pool ) {
+  const Header *h = (const Header *) header;
+  alloc( h, contents != 0, pool );
+  if ( contents && _raw ) {
+    _data = (h->csize() > 0)? ((tByte*) _header) + h->hsize() : 0;
+    if ( _data ) memcpy( _data, contents, h->csize() );
+  }
+  else if ( contents && (h->size() > 0) ) {
+    // decompress file contents
+    _data = ((tByte*) _header) + h->hsize();
+    try {
+      switch ( h->compression() ) {
+        case Header::Stored : 
+          // contents has csize bytes only
+          if ( h->csize() != h->size() )
+            throw Exception( "zip archive corrupt (size error)" );
+          if ( copyCrc( (tByte *) _data, (const tByte *) contents, h->size(),
+                        0 ) != h->crc32() )
+            throw Exception( "zip archive corrupt (CRC32 error)" );
+          break;
+        case Header::Deflated : inflate( contents, inflater ); break;
+        default: decode( contents, inflater ); break;
+      }
+    }
+    // the destructor isn't called if a constructor throws
+    catch ( ... ) { clear(); throw; }
+  }
+  else _data = 0;
+}
+
+
+/**
+ *  The File::~File destructor releases all allocated data.
+ */
+
+File::~File() {
+  clear();
+}
+
+
+/**
+ *  File::clear releases the Header and data (to the Pool if any).
+ */
+
+void File::clear( void ) {
+  if ( _path ) {
+    // data mapped from a temporary file
+    if ( _data ) munmap( _data, size() );
+    unlink( _path );
+    free( _path );
+    _data = 0;
+    _path = 0;
+  }
+  if ( _arena ) ((Arena *) _arena) -> release();
+  else {
+    if ( _header ) {
+      if ( _pool ) {
+        Header *h = (Header *) _header;
+        ((Pool *) _pool) -> put( _header, 
+                                 h->hsize() + (_data? size() + 4 : 0) );
+        ((Pool *) _pool) -> release();
+      }
+      else free( _header );
+    }
+    if ( _name ) free( _name );
+  }
+  _header = _data = 0;
+  _name = 0;
+  _pool = _arena = 0;
+}
+
+
+/**
+ *  MappedPayload is the context of a Payload mapped from a temporary file,
+ *  which is unmapped and removed by disposeMapped.
+ */
+
+struct MappedPayload { void *data; long size; char *path; };
+
+static void disposeMapped( void *context ) {
+  MappedPayload *m = (MappedPayload *) context;
+  munmap( m->data, m->size );
+  unlink( m->path );
+  free( m->path );
+  free( m );
+}
+
+static void disposeArena( void *context ) { 
+  ((Arena *) context) -> release(); 
+}
+
+
+/**
+ *  File::release hands the data of the File over to the caller. The data 
+ *  isn't copied, instead the File gets a copy of its Header (and name if 
+ *  allocated in an Arena) and the buffer holding the data is freed by 
+ *  Payload::dispose: a buffer from the Pool or malloc is freed, an Arena 
+ *  is released and data mapped from a temporary file is unmapped and the
+ *  file removed.
+ */
+
+Payload File::release( void ) {
+  Payload ret = { _data, 0, 0, 0 };
+  if ( !_data ) return ret;
+  const Header *h = (const Header *) _header;
+  ret.size = size();
+  void *header = malloc( h->hsize() );
+  if ( !header ) throw Exception();
+  memcpy( header, h, h->hsize() );
+  if ( _path ) {
+    MappedPayload *m = (MappedPayload *) malloc( sizeof( MappedPayload ) );
+    if ( !m ) { free( header ); throw Exception(); }
+    m->data = _data; m->size = ret.size; m->path = _path;
+    ret.dealloc = disposeMapped;
+    ret.context = m;
+    _path = 0;
+    if ( _pool ) ((Pool *) _pool) -> put( _header, h->hsize() );
+    else free( _header );
+  }
+  else if ( _arena ) {
+    char *name = h->heapFilename();
+    if ( !name ) { free( header ); throw Exception(); }
+    // the File's reference to the Arena is passed on
+    ret.dealloc = disposeArena;
+    ret.context = _arena;
+    _arena = 0;
+    _name = name;
+  }
+  else {
+    // buffers of a Pool are allocated by malloc, too
+    ret.dealloc = free;
+    ret.context = _header;
+  }
+  if ( _pool ) ((Pool *) _pool) -> release();
+  _pool = 0;
+  _header = header;
+  _data = 0;
+  return ret;
+}
+
+
+/**
+ *  File::size returns the file's size (uncompressed), i.e. the size of 
+ *  data(). For raw Files this is the compressed size.
+ */
+
+int File::size( void ) const {
+  Header *h = (Header *) _header;
+  return _raw? h->csize() : h->size();
+}
+
+
+/**
+ *  A StreamEntry is used to decompress the contents of a file chunk by 
+ *  chunk. The uncompressed data is passed to the delegate in windows of 
+ *  at most WindowSize bytes. In streaming mode StreamEntries are used for
+ *  all files, otherwise only for deflated files using a data descriptor.
+ *  The end of such files is given by the end of the deflated stream (so no
+ *  signature has to be searched in the compressed data).
+ */
+
+class StreamEntry {
+
+  public:
+  File		 *_file;	// File (Header and name only)
+  StreamDelegate *_delegate;	// delegate to pass the data to
+  int		  _sized;	// size of compressed data known
+  int		  _filter;	// StreamDelegate::acceptFile's result
+  unsigned	  _remaining;	// #compressed bytes still to process (sized)
+  unsigned long	  _consumed;	// #compressed bytes processed
+  unsigned long	  _crc;		// CRC-32 of data processed so far
+  int		  _ended;	// end of deflated stream found
+  z_stream	 *_zs;		// libz stream state (Deflated)
+  Decoder	 *_decoder;	// Decoder (other compression methods)
+  unsigned long	  _produced;	// #bytes decompressed
+  tByte		 *_window;	// output window (0: Stored), the Inflater's
+  unsigned long	  _skip;	// #bytes of output not to pass (resumed)
+  int		  _last;	// last byte of deflated data consumed
+
+  // state of _zs at the end of a deflate block (to resume from)
+  struct {
+    unsigned long in;		// #compressed bytes consumed
+    unsigned long out;		// #bytes produced
+    unsigned long crc;		// CRC-32 of the bytes produced
+    int		  bits;		// #bits of the last byte consumed not used
+    int		  byte;		// last byte consumed
+    unsigned	  dictlen;	// #bytes in dict
+    tByte	 *dict;		// last 32k of output
+  } _snapshot;
+
+  enum { WindowSize = 64*1024, SnapshotInterval = 256*1024 };
+
+  StreamEntry( const Header *h, int sized, StreamDelegate *delegate, 
+               Inflater *inflater, int filter = StreamDelegate::Accept,
+               bool resumed = false );
+  ~StreamEntry();
+
+  // decompresses data and passes the output to the delegate, returns the 
+  // #bytes consumed
+  int process( const tByte *data, int len );
+
+  // passes len bytes of decompressed data to the delegate
+  void output( const tByte *data, int len );
+
+  // records the state of _zs at the end of a deflate block, used is the 
+  // #bytes of data consumed
+  void snapshot( const tByte *data, int used );
+
+  // all compressed data processed?
+  int isDone( void ) const { return _sized? (_remaining == 0) : _ended; }
+
+  // sets sizes and CRC from the DataDescriptor following the data
+  void setDataDescriptor( DataDescriptor *dd );
+
+  // checks the CRC and informs the delegate
+  void finish( void );
+
+}; // class StreamEntry
+
+StreamEntry::StreamEntry( const Header *h, int sized, 
+                          StreamDelegate *delegate, Inflater *inflater,
+                          int filter, bool resumed ) {
+  // the destructor isn't called if the decoder lookup or beginFile throws
+  FilePtr file( new File( h, 0, 0, 0, filter == StreamDelegate::DataOnly ) );
+  _file = 0;
+  _delegate = (filter == StreamDelegate::Skip)? 0 : delegate;
+  _sized = sized;
+  _filter = filter;
+  _remaining = sized? h->csize() : 0;
+  _consumed = 0;
+  _crc = 0;
+  _ended = 0;
+  _window = 0;
+  _zs = 0;
+  _decoder = 0;
+  _produced = 0;
+  _skip = 0;
+  _last = 0;
+  memset( &_snapshot, 0, sizeof _snapshot );
+  // the data of skipped or raw files of known size is passed as is
+  if ( !sized || (filter == StreamDelegate::Accept) ) {
+    switch ( h->compression() ) {
+      case Header::Stored : break;
+      case Header::Deflated : _zs = inflater -> begin(); break;
+      default: _decoder = inflater -> decoder( h->compression() ); break;
+  } }
+  if ( _zs || _decoder ) _window = inflater -> window( WindowSize );
+  if ( _delegate && !resumed ) _delegate -> beginFile( file.get() );
+  _file = file.release();
+}
+
+StreamEntry::~StreamEntry() {
+  if ( _snapshot.dict ) free( _snapshot.dict );
+  if ( _file ) delete _file;
+  _window = 0; _file = 0;
+}
+
+int StreamEntry::process( const tByte *data, int len ) {
+  if ( _sized && ((unsigned) len > _remaining) ) len = _remaining;
+  if ( len <= 0 ) return 0;
+  int n = len;
+  int accept = (_filter == StreamDelegate::Accept);
+  if ( !_window ) {
+    if ( accept ) _crc = crc32Update( _crc, data, len );
+    if ( _delegate ) _delegate -> handleData( _file, data, len );
+  }
+  else if ( _decoder ) {
+    const tByte *in = data;
+    long inlen = len, avail = 0;
+    while ( !_ended && ((inlen > 0) || (avail == 0)) ) {
+      tByte *out = _window;
+      avail = WindowSize;
+      const tByte *i = in;
+      if ( _decoder -> decode( in, inlen, out, avail ) ) _ended = 1;
+      int produced = WindowSize - (int) avail;
+      if ( produced > 0 ) {
+        _crc = crc32Update( _crc, _window, produced );
+        _produced += produced;
+        _delegate -> handleData( _file, _window, produced );
+      }
+      else if ( in == i ) break;
+    }
+  }
+  else {
+    _zs->next_in = (tByte *) data;
+    _zs->avail_in = len;
+    bool last = false;
+    while ( !_ended && 
+            ((_zs->avail_in > 0) || (_zs->avail_out == 0) || last) ) {
+      _zs->next_out = _window;
+      _zs->avail_out = WindowSize;
+      // stop at the end of the next deflate block if a snapshot is due
+      bool snap = !last && (_consumed + (len - _zs->avail_in) >= 
+                            _snapshot.in + SnapshotInterval);
+      int ret = ::inflate( _zs, snap? Z_BLOCK : Z_NO_FLUSH );
+      int produced = WindowSize - _zs->avail_out;
+      if ( (produced > 0) && accept ) output( _window, produced );
+      // Z_BLOCK returns before the end of the last block ends the stream
+      last = snap && (ret == Z_OK) && ((_zs->data_type & 192) == 192);
+      if ( ret == Z_STREAM_END ) _ended = 1;
+      else if ( snap && ((ret == Z_OK) || (ret == Z_BUF_ERROR)) &&
+                ((_zs->data_type & 192) == 128) ) 
+        snapshot( data, len - _zs->avail_in );
+      else if ( ret == Z_BUF_ERROR ) break;
+      else if ( ret != Z_OK ) inflateError( ret );
+    }
+    if ( (int) _zs->avail_in < len ) _last = data[len - _zs->avail_in - 1];
+    // bytes following the end of an unsized stream are not consumed
+    if ( !_sized ) n = len - _zs->avail_in;
+    // raw files of unknown size are inflated only to find their end
+    if ( _delegate && !accept ) _delegate -> handleData( _file, data, n );
+  }
+  if ( _sized ) _remaining -= n;
+  _consumed += n;
+  return n;
+}
+
+void StreamEntry::output( const tByte *data, int len ) {
+  _crc = crc32Update( _crc, data, len );
+  _produced += len;
+  if ( _skip > 0 ) {
+    // this data has been passed before the Stream has been restored
+    int n = (_skip < (unsigned long) len)? (int) _skip : len;
+    _skip -= n;
+    data += n;
+    len -= n;
+  }
+  if ( len > 0 ) _delegate -> handleData( _file, data, len );
+}
+
+void StreamEntry::snapshot( const tByte *data, int used ) {
+  if ( !_snapshot.dict && !(_snapshot.dict = (tByte *) malloc( 32*1024 )) )
+    throw Exception();
+  uInt dictlen = 32*1024;
+  if ( inflateGetDictionary( _zs, _snapshot.dict, &dictlen ) != Z_OK )
+    throw Exception( "libz: inflateGetDictionary failed" );
+  _snapshot.dictlen = dictlen;
+  _snapshot.in = _consumed + used;
+  _snapshot.out = _produced;
+  _snapshot.crc = _crc;
+  _snapshot.bits = _zs->data_type & 7;
+  _snapshot.byte = (used > 0)? data[used - 1] : _last;
+}
+
+void StreamEntry::setDataDescriptor( DataDescriptor *dd ) {
+  if ( dd->csize() != _consumed )
+    throw Exception( "zip archive corrupt (data descriptor)" );
+  ((Header *) _file->header()) -> setDataDescriptor( dd );
+}
+
+void StreamEntry::finish( void ) {
+  Header *h = (Header *) _file->header();
+  if ( _zs && !_ended ) inflateError( Z_OK );
+  if ( _decoder && !_ended && (_produced != h->size()) ) 
+    throw Exception( "zip archive corrupt (size error)" );
+  // the CRC of raw files isn't checked
+  if ( _delegate ) 
+    _delegate -> endFile( _file, (_filter != StreamDelegate::Accept) || 
+                                 (_crc == h->crc32()) );
+}
+
+
+/**
+ *  A Collector is the StreamDelegate of StreamEntries used outside of 
+ *  streaming mode. It collects the uncompressed data in a growing block
+ *  (preceeded by the Header) which is finally passed as File to the 
+ *  Stream's delegate. The blocks are taken from the Stream's Pool, so 
+ *  they are reused once the Files have been deleted.
+ */
+
+class Collector : public StreamDelegate {
+
+  public:
+  StreamDelegate	*_delegate;	// delegate to pass Files to
+  Pool			*_pool;		// Pool of blocks
+  tByte			*_block;	// Header and uncompressed data
+  long			 _len;		// #bytes in _block
+  long			 _size;		// #bytes allocated
+  Spill			*_spill;	// data exceeding _limit (or 0)
+  long			 _limit;	// max. #bytes in memory (0: no limit)
+  std::string		 _tmpdir;	// directory of Spills
+
+  Collector( StreamDelegate *delegate, Pool *pool ) { 
+    _delegate = delegate; _pool = pool; _block = 0; _len = _size = 0; 
+    _spill = 0; _limit = 0; 
+  }
+  ~Collector() { 
+    if ( _block ) _pool -> put( _block, _size ); 
+    if ( _spill ) delete _spill; 
+  }
+
+  // makes room for size bytes in _block keeping the first _len bytes
+  void reserve( long size );
+
+  void beginFile( const File *file );
+  void handleData( const File *file, const void *data, int len );
+  void endFile( const File *file, bool crcOk );
+
+}; // class Collector
+
+void Collector::reserve( long size ) {
+  if ( _block && (size <= _size) ) return;
+  long capacity = Pool::capacity( size );
+  tByte *b = (tByte *) _pool -> get( capacity );
+  if ( !b ) throw Exception();
+  if ( _block ) {
+    memcpy( b, _block, _len );
+    _pool -> put( _block, _size );
+  }
+  _block = b;
+  _size = capacity;
+}
+
+void Collector::beginFile( const File *file ) {
+  Header *h = (Header *) file->header();
+  if ( _spill ) delete _spill;
+  _spill = 0;
+  _len = 0;
+  reserve( h->hsize() + StreamEntry::WindowSize );
+  memcpy( _block, h, h->hsize() );
+  _len = h->hsize();
+}
+
+void Collector::handleData( const File *file, const void *data, int len ) {
+  long hsize = ((Header *) file->header()) -> hsize();
+  if ( !_spill && _limit && (_len - hsize + len > _limit) ) {
+    // move the data collected so far to a temporary file
+    _spill = new Spill( _tmpdir );
+    _spill -> append( _block + hsize, _len - hsize );
+    _len = hsize;
+  }
+  if ( _spill ) { _spill -> append( (const tByte *) data, len ); return; }
+  if ( _len + len > _size ) reserve( std::max( _size * 2, _len + len ) );
+  memcpy( _block + _len, data, len );
+  _len += len;
+}
+
+void Collector::endFile( const File *file, bool crcOk ) {
+  Header *h = (Header *) file->header();
+  if ( !crcOk ) throw Exception( "zip archive corrupt (CRC32 error)" );
+  if ( _spill ) {
+    std::unique_ptr<Spill> s( _spill );
+    _spill = 0;
+    _delegate -> handleFile( s -> file( h, file->isRaw() ) );
+    return;
+  }
+  if ( _len - h->hsize() != file->size() ) 
+    throw Exception( "zip archive corrupt (size error)" );
+  // the File takes over the block, which File::clear returns to the Pool 
+  // as buffer of hsize+size+4 bytes
+  reserve( _len + 4 );
+  memcpy( _block, h, h->hsize() );
+  FilePtr f( new File );
+  f->_header = _block;
+  f->_name = h->heapFilename();
+  f->_raw = file->isRaw();
+  f->_data = (f->size() > 0)? _block + h->hsize() : 0;
+  f->_pool = _pool;
+  _pool -> retain();
+  _block = 0;
+  _delegate -> handleFile( std::move( f ) );
+}
+
+
+/**
+ *  ticks returns a cheap timestamp (the CPU's time stamp counter if 
+ *  available), ticks are converted to nanoseconds by Stream::stats.
+ */
+
+static inline long long ticks( void ) {
+#if defined(ZIP_SIMD_X86)
+  return (long long) __rdtsc();
+#elif defined(__aarch64__)
+  long long t;
+  asm volatile( "mrs %0, cntvct_el0" : "=r" (t) );
+  return t;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch() ).count();
+#endif
+}
+
+
+/**
+ *  A Monitor is the StreamDelegate used by a Stream, it passes all calls 
+ *  to the Stream's delegate and records the time spent there (in ticks) 
+ *  and the #files and #bytes passed in the Stream's StreamStats.
+ *  If batching is enabled, Files are collected in _batch and passed to
+ *  the delegate's handleFiles when _maxFiles Files or _maxBytes bytes have
+ *  been collected, before a streamed file begins and at the end of 
+ *  Stream::scan (see flush).
+ */
+
+class Monitor : public StreamDelegate {
+
+  public:
+  StreamDelegate	*_delegate;	// delegate to pass calls to
+  StreamStats		*_stats;	// statistics to update
+  bool			 _timing;	// record the time spent
+  bool			 _batching;	// collect Files in _batch
+  int			 _maxFiles;	// max. #Files per batch (0: any)
+  long			 _maxBytes;	// max. #bytes per batch (0: any)
+  std::vector<FilePtr>	 _batch;	// Files not yet passed
+  std::vector<FilePtr>	 _passed;	// Files passed by flush
+  long			 _batchBytes;	// #bytes of Files in _batch
+
+  Monitor( StreamDelegate *delegate, StreamStats *stats ) { 
+    _delegate = delegate; _stats = stats; _timing = true; 
+    _batching = false; _maxFiles = 0; _maxBytes = _batchBytes = 0;
+  }
+
+  long long now( void ) const { return _timing? ticks() : 0; }
+
+  // returns true if the data of the File is decompressed
+  static bool isDecompressed( const File *file ) {
+    return !file->isRaw() && 
+      (((Header *) file->header()) -> compression() != Header::Stored);
+  }
+
+  int acceptFile( const File *file ) {
+    long long start = now();
+    int ret = _delegate -> acceptFile( file );
+    _stats->delegate += now() - start;
+    if ( ret == Skip ) _stats->skippedFiles++;
+    return ret;
+  }
+
+  void handleFile( FilePtr file ) {
+    _stats->files++;
+    if ( isDecompressed( file.get() ) ) _stats->bytesInflated += file->size();
+    if ( _batching ) {
+      _batchBytes += file->size();
+      _batch.push_back( std::move( file ) );
+      if ( (_maxFiles && ((int) _batch.size() >= _maxFiles)) ||
+           (_maxBytes && (_batchBytes >= _maxBytes)) ) 
+        flush();
+      return;
+    }
+    long long start = now();
+    _delegate -> handleFile( std::move( file ) );
+    _stats->delegate += now() - start;
+  }
+
+  // passes the Files collected to the delegate
+  void flush( void ) {
+    if ( _batch.empty() ) return;
+    _passed.swap( _batch );
+    _batchBytes = 0;
+    long long start = now();
+    // Files not taken by the delegate are deleted right away, since they
+    // may keep a whole arena generation alive
+    try { _delegate -> handleFiles( _passed.data(), (int) _passed.size() ); }
+    catch ( ... ) { _passed.clear(); throw; }
+    _stats->delegate += now() - start;
+    _passed.clear();
+  }
+
+  void beginFile( const File *file ) {
+    flush();
+    _stats->files++;
+    long long start = now();
+    _delegate -> beginFile( file );
+    _stats->delegate += now() - start;
+  }
+
+  void handleData( const File *file, const void *data, int len ) {
+    if ( isDecompressed( file ) ) _stats->bytesInflated += len;
+    long long start = now();
+    _delegate -> handleData( file, data, len );
+    _stats->delegate += now() - start;
+  }
+
+  void endFile( const File *file, bool crcOk ) {
+    long long start = now();
+    _delegate -> endFile( file, crcOk );
+    _stats->delegate += now() - start;
+  }
+
+  void resumeFile( const File *file, long offset ) {
+    flush();
+    long long start = now();
+    _delegate -> resumeFile( file, offset );
+    _stats->delegate += now() - start;
+  }
+
+}; // class Monitor
+
+
+/**
+ *  A Timer adds the ticks of its lifetime to *t, excluding the ticks 
+ *  *exclude has been increased by meanwhile (e.g. the time spent in the 
+ *  delegate). A Timer which is not 'on' does nothing.
+ */
+
+class Timer {
+
+  long long		 _start;	// ticks at construction
+  long long		*_t;		// time to update (0: off)
+  const long long	*_exclude;	// time to exclude
+  long long		 _excluded;	// *_exclude at start
+
+  public:
+  Timer( bool on, long long *t, const long long *exclude = 0 ) 
+    : _start( on? ticks() : 0 ), _t( on? t : 0 ), _exclude( exclude ), 
+      _excluded( exclude? *exclude : 0 ) {}
+  ~Timer() { 
+    if ( _t ) 
+      *_t += ticks() - _start - (_exclude? *_exclude - _excluded : 0); 
+  }
+
+}; // class Timer
+
+
+/**
+ *  A Serializer appends values to a string or reads them from a string. 
+ *  Values are stored in host byte order, since a checkpoint is meant to be
+ *  restored on the same device.
+ */
+
+class Serializer {
+
+  public:
+  std::string		*_out;		// string to write to
+  const std::string	*_in;		// string to read from
+  size_t		 _pos;		// read position
+
+  enum { Magic = 0x5a534331 };	// "ZSC1"
+
+  Serializer( std::string *out ) { _out = out; _in = 0; _pos = 0; }
+  Serializer( const std::string *in ) { _out = 0; _in = in; _pos = 0; }
+
+  template <class T> void put( T val ) 
+    { _out -> append( (const char *) &val, sizeof val ); }
+  void put( const void *data, long len ) 
+    { put( len ); _out -> append( (const char *) data, len ); }
+
+  const tByte *read( long len ) {
+    if ( (len < 0) || (_pos + len > _in->size()) ) 
+      throw Exception( "invalid checkpoint" );
+    const tByte *ret = (const tByte *) _in->data() + _pos;
+    _pos += len;
+    return ret;
+  }
+  template <class T> T get( void ) 
+    { T val; memcpy( &val, read( sizeof val ), sizeof val ); return val; }
+  const tByte *get( long *len ) { *len = get<long>(); return read( *len ); }
+
+}; // class Serializer
+
+
+/**
+ *  The default implementation of StreamDelegate::handleFile prints the file 
+ *  name and some header data to stdout.
+ */
+
+void StreamDelegate::handleFile( FilePtr file ) {
+  char buff[1024];
+  Header *h = (Header*)(file->header());
+  h -> toAscii( buff, 1024 );
+  printf( "%s: %s\n", file->name(), buff );
+  fflush( stdout );
+}
+
+
+/**
+ *  The default implementation of StreamDelegate::handleFiles passes the 
+ *  Files one by one to handleFile.
+ */
+
+void StreamDelegate::handleFiles( FilePtr *files, int n ) {
+  for ( int i = 0; i < n; i++ ) handleFile( std::move( files[i] ) );
+}
+
+
+/**
+ *  The default implementation of StreamDelegate::acceptFile accepts all 
+ *  files.
+ */
+
+int StreamDelegate::acceptFile( const File * ) { return Accept; }
+
+
+/**
+ *  The default implementations of StreamDelegate::beginFile and 
+ *  StreamDelegate::handleData ignore the file, StreamDelegate::endFile
+ *  prints the file name, some header data and the CRC verdict.
+ */
+
+void StreamDelegate::beginFile( const File * ) {}
+
+void StreamDelegate::handleData( const File *, const void *, int ) {}
+
+void StreamDelegate::endFile( const File *file, bool crcOk ) {
+  char buff[1024];
+  Header *h = (Header*)(file->header());
+  h -> toAscii( buff, 1024 );
+  printf( "%s: %s%s\n", file->name(), buff, crcOk? "" : " CRC32 error" );
+  fflush( stdout );
+}
+
+
+/**
+ *  The default implementation of StreamDelegate::resumeFile does nothing, 
+ *  i.e. the delegate is expected to keep the state of the file itself.
+ */
+
+void StreamDelegate::resumeFile( const File *, long ) {}
+
+
+/**
+ *  The Stream constructor allocates a Buffer object to store the read data 
+ */
+
+Stream::Stream( StreamDelegate &delegate ) {
+  memset( &_stats, 0, sizeof _stats );
+  _created[0] = ticks();
+  _created[1] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch() ).count();
+  _delegate = new Monitor( &delegate, &_stats );
+  _timing = true;
+  _buffer = new Buffer;
+  _entry = 0;
+  _inflater = new Inflater;
+  _pool = new Pool;
+  _collector = new Collector( _delegate, (Pool *) _pool );
+  _streaming = false;
+  _filter = StreamDelegate::Accept;
+  _limit = 0;
+  _bytes_read = 0;
+}
+
+
+/**
+ *  Stream::setMemoryLimit limits the memory used for a single file to 
+ *  about limit bytes (0: no limit). The data of larger files is written 
+ *  to a temporary file in tmpdir (0: $TMPDIR or /tmp) and the File passed 
+ *  to the delegate maps it (see File::path). Compressed data of unknown 
+ *  size is spilled likewise.
+ */
+
+void Stream::setMemoryLimit( long limit, const char *tmpdir ) {
+  Buffer *b = (Buffer *) _buffer;
+  Collector *c = (Collector *) _collector;
+  _limit = (limit > 0)? limit : 0;
+  b->_rope._limit = c->_limit = _limit;
+  b->_rope._tmpdir = c->_tmpdir = tmpdir? tmpdir : "";
+}
+
+
+/**
+ *  Stream::setArena switches arena mode on or off. In arena mode the 
+ *  buffers (Header and data) and names of the Files found are allocated 
+ *  from large slabs of the current arena generation instead of being 
+ *  allocated and freed one by one. Deleting such a File frees only the
+ *  File object and drops a reference, the slabs of a generation are 
+ *  returned to the Stream's pool when all of its Files have been deleted.
+ *  A new generation is started by releaseArena (e.g. after a batch of 
+ *  Files has been handled) or automatically after 64 MB. Files of 
+ *  deflated data of unknown size and Files kept in temporary files are 
+ *  still allocated individually. Arena mode is meant for Files kept and
+ *  deleted in other threads (e.g. with several Streams in parallel), for
+ *  Files deleted right away the pool's reuse of buffers is faster.
+ */
+
+void Stream::setArena( bool arena ) {
+  Pool *p = (Pool *) _pool;
+  if ( arena && !p->_arena ) p->_arena = new Arena( p );
+  else if ( !arena && p->_arena ) {
+    p->_arena -> release();
+    p->_arena = 0;
+} }
+
+
+/**
+ *  Stream::releaseArena starts a new arena generation (in arena mode), 
+ *  the previous one is freed as soon as all of its Files have been 
+ *  deleted.
+ */
+
+void Stream::releaseArena( void ) {
+  Pool *p = (Pool *) _pool;
+  if ( p->_arena ) {
+    p->_arena -> release();
+    p->_arena = new Arena( p );
+} }
+
+
+/**
+ *  Stream::setBatching lets the Stream collect the Files found and pass 
+ *  them to StreamDelegate::handleFiles when 'files' Files or 'bytes' 
+ *  bytes (uncompressed) have been collected (0: no limit). Pending Files
+ *  are passed at the end of every call of scan and before a file is 
+ *  streamed, so the order of files is kept. With files and bytes being 0
+ *  every File is passed to handleFile as it is found.
+ */
+
+void Stream::setBatching( int files, long bytes ) {
+  Monitor *m = (Monitor *) _delegate;
+  m->flush();
+  m->_maxFiles = (files > 0)? files : 0;
+  m->_maxBytes = (bytes > 0)? bytes : 0;
+  m->_batching = m->_maxFiles || m->_maxBytes;
+}
+
+
+/**
+ *  Stream::exceedsLimit returns true if the data of the file with the 
+ *  given Header is larger than the memory limit.
+ */
+
+bool Stream::exceedsLimit( const void *header ) const {
+  const Header *h = (const Header *) header;
+  return _limit && 
+         (((long) h->size() > _limit) || ((long) h->csize() > _limit));
+}
+
+
+/**
+ *  Stream::setTiming switches the recording of the time spent in the 
+ *  phases of Stream::scan on or off (it is on by default). Timing costs 
+ *  a few reads of the time stamp counter per file, which may be 
+ *  noticeable with lots of tiny stored files.
+ */
+
+void Stream::setTiming( bool timing ) {
+  _timing = ((Monitor *) _delegate) -> _timing = timing;
+}
+
+
+/**
+ *  Stream::stats returns the statistics of the data scanned so far. The 
+ *  ticks recorded are converted to nanoseconds using the ticks and 
+ *  nanoseconds passed since the Stream has been created.
+ */
+
+StreamStats Stream::stats( void ) const {
+  Buffer *b = (Buffer *) _buffer;
+  StreamStats ret = _stats;
+  long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch() ).count();
+  long long t = ticks() - _created[0];
+  double scale = (t > 0)? (double) (ns - _created[1]) / t : 1;
+  ret.scan = (long long) (ret.scan * scale);
+  ret.decode = (long long) (ret.decode * scale);
+  ret.delegate = (long long) (ret.delegate * scale);
+  ret.bytesSkipped = b->_skipped;
+  ret.bytesCopied = b->_copied;
+  ret.reallocs = b->_reallocs;
+  ret.bytesMoved = b->_moved;
+  return ret;
+}
+
+
+/**
+ *  Stream::reallocs returns the #reallocations of the Stream's buffer, 
+ *  Stream::bytesMoved the #bytes moved by these reallocations.
+ */
+
+long Stream::reallocs( void ) const { return ((Buffer *) _buffer) -> _reallocs; }
+
+long Stream::bytesMoved( void ) const { return ((Buffer *) _buffer) -> _moved; }
+
+
+/**
+ *  The Stream destructor releases all allocated structures.
+ */
+
+Stream::~Stream() {
+  Buffer *b = (Buffer *) _buffer;
+  if ( _delegate ) delete (Monitor *) _delegate;
+  _delegate = 0;
+  if ( b ) delete b;
+  if ( _entry ) delete (StreamEntry *) _entry;
+  if ( _inflater ) delete (Inflater *) _inflater;
+  if ( _collector ) delete (Collector *) _collector;
+  if ( _pool ) { setArena( false ); ((Pool *) _pool) -> release(); }
+  _buffer = _entry = _inflater = _pool = _collector = 0;
+}
+
+
+/**
+ *  Stream::accept asks the delegate whether to accept, skip or pass the 
+ *  raw data of the file with the given Header. The File passed borrows the
+ *  Header from the Stream's buffer and the name from the stack (unless
+ *  exceptionally long), so no buffer is taken from the Pool or Arena.
+ */
+
+int Stream::accept( const void *header ) {
+  const Header *h = (const Header *) header;
+  char buff[1024];
+  // a File borrowing Header and name, which must not be freed
+  struct View {
+    File f;
+    char *buff;
+    ~View() { if ( f._name != buff ) free( f._name ); f._header = f._name = 0; }
+  } view;
+  view.buff = buff;
+  int l = h->fnlength();
+  if ( l < (int) sizeof buff ) {
+    memcpy( buff, h->filename(), l );
+    buff[l] = '\0';
+    view.f._name = buff;
+  }
+  else view.f._name = h->heapFilename();
+  view.f._header = (void *) header;
+  return _delegate -> acceptFile( &view.f );
+}
+
+
+/**
+ *  Stream::checkpoint saves the state of the Stream to 'state' and returns
+ *  the offset in the archive to continue scanning at after the state has 
+ *  been restored (see Stream::restore). Between two files or within stored
+ *  data this is the #bytes scanned so far (including data copied to the 
+ *  Buffer). Deflated data is resumed at the end of the deflate block last
+ *  recorded by the StreamEntry (about every SnapshotInterval bytes), the 
+ *  data decompressed again is not passed to the delegate twice. 
+ *  Checkpoints within files compressed by other methods, within raw data 
+ *  of unknown size or with spilled data collected (by the Collector or in
+ *  the Buffer's Rope of unsized stored data) aren't supported, -1 is 
+ *  returned in these cases.
+ */
+
+long Stream::checkpoint( std::string &state ) const {
+  Buffer *b = (Buffer *) _buffer;
+  StreamEntry *e = (StreamEntry *) _entry;
+  Collector *c = (Collector *) _collector;
+  long offset = _bytes_read;
+  unsigned long consumed = 0, crc = 0, produced = 0, skip = 0;
+  unsigned remaining = 0;
+  int bits = 0, byte = 0;
+  const tByte *dict = 0;
+  unsigned dictlen = 0;
+  if ( b->_rope._spill ) return -1;
+  if ( e ) {
+    consumed = e->_consumed; crc = e->_crc; produced = e->_produced; 
+    remaining = e->_remaining; byte = e->_last;
+    if ( e->_decoder && !e->_ended ) return -1;
+    if ( !_streaming && c->_spill ) return -1;
+    if ( e->_zs && !e->_ended ) {
+      if ( e->_delegate && (e->_filter != StreamDelegate::Accept) ) 
+        return -1;
+      unsigned long back = consumed - e->_snapshot.in;
+      offset -= back;
+      if ( e->_sized ) remaining += back;
+      consumed = e->_snapshot.in;
+      crc = e->_snapshot.crc;
+      skip = produced - e->_snapshot.out;
+      produced = e->_snapshot.out;
+      bits = e->_snapshot.bits;
+      byte = e->_snapshot.byte;
+      dict = e->_snapshot.dict;
+      dictlen = dict? e->_snapshot.dictlen : 0;
+  } }
+  state.clear();
+  Serializer s( &state );
+  s.put<unsigned>( Serializer::Magic );
+  s.put( offset );
+  s.put( _streaming );
+  s.put( _filter );
+  s.put( b->_buffer, b->_len );
+  s.put( b->_flags );
+  s.put( b->_ddlen );
+  s.put( b->_dd, sizeof b->_dd );
+  s.put( b->_discarded );
+  s.put( b->_slen );
+  s.put( (b->_signature == Header::signature)? 1 :
+         (b->_signature == DataDescriptor::signature)? 2 : 0 );
+  s.put( b->_rope._len );
+  b->_rope.forEach( [&state]( const tByte *data, int len ) 
+    { state.append( (const char *) data, len ); } );
+  s.put( e != 0 );
+  if ( e ) {
+    s.put( e->_sized );
+    s.put( remaining );
+    s.put( consumed );
+    s.put( crc );
+    s.put( e->_ended );
+    s.put( produced );
+    s.put( skip );
+    s.put( bits );
+    s.put( byte );
+    s.put( dict, dictlen );
+    if ( !_streaming ) s.put( c->_block, c->_len );
+  }
+  return offset;
+}
+
+
+/**
+ *  Stream::restore restores the state saved by Stream::checkpoint, it must 
+ *  be called before any data is scanned. The data following the offset 
+ *  returned by checkpoint is to be scanned next. If a file is continued, 
+ *  the delegate's resumeFile is called.
+ */
+
+void Stream::restore( const std::string &state ) {
+  Buffer *b = (Buffer *) _buffer;
+  Collector *c = (Collector *) _collector;
+  Serializer s( &state );
+  const tByte *p;
+  long n;
+  if ( _entry || _bytes_read || !b->isIdle() )
+    throw Exception( "can't restore a Stream in use" );
+  if ( s.get<unsigned>() != Serializer::Magic ) 
+    throw Exception( "invalid checkpoint" );
+  _bytes_read = s.get<long>();
+  _streaming = s.get<bool>();
+  _filter = s.get<int>();
+  p = s.get( &n );
+  b->reserve( (int) n + 4 );
+  memcpy( b->_buffer, p, n );
+  b->_len = (int) n;
+  b->_flags = s.get<int>();
+  b->_ddlen = s.get<int>();
+  p = s.get( &n );
+  if ( n != sizeof b->_dd ) throw Exception( "invalid checkpoint" );
+  memcpy( b->_dd, p, n );
+  b->_discarded = s.get<long>();
+  b->_slen = s.get<int>();
+  switch ( s.get<int>() ) {
+    case 1: b->_signature = Header::signature; break;
+    case 2: b->_signature = DataDescriptor::signature; break;
+    default: b->_signature = 0;
+  }
+  p = s.get( &n );
+  for ( long off = 0; off < n; off += 1L << 30 )
+    b->_rope.append( p + off, 
+                     (int) ((n - off < (1L << 30))? n - off : 1L << 30) );
+  if ( s.get<bool>() ) {
+    int sized = s.get<int>();
+    StreamDelegate *d = _streaming? _delegate : c;
+    StreamEntry *e = new StreamEntry( b->header(), sized, d, 
+                                      (Inflater *) _inflater, _filter, true );
+    _entry = e;
+    e->_remaining = s.get<unsigned>();
+    e->_consumed = s.get<unsigned long>();
+    e->_crc = s.get<unsigned long>();
+    e->_ended = s.get<int>();
+    e->_produced = s.get<unsigned long>();
+    e->_skip = s.get<unsigned long>();
+    int bits = s.get<int>();
+    e->_last = s.get<int>();
+    const tByte *dict = s.get( &n );
+    if ( e->_zs && !e->_ended ) {
+      // continue inflating at the end of the deflate block recorded
+      if ( (n > 32*1024) || 
+           (bits && (inflatePrime( e->_zs, bits, e->_last >> (8 - bits) ) 
+                     != Z_OK)) ||
+           ((n > 0) && (inflateSetDictionary( e->_zs, dict, (uInt) n ) 
+                        != Z_OK)) )
+        throw Exception( "invalid checkpoint" );
+      // which is the snapshot to resume from until the next one
+      e->_snapshot.in = e->_consumed;
+      e->_snapshot.out = e->_produced;
+      e->_snapshot.crc = e->_crc;
+      e->_snapshot.bits = bits;
+      e->_snapshot.byte = e->_last;
+      if ( n > 0 ) {
+        if ( !(e->_snapshot.dict = (tByte *) malloc( 32*1024 )) ) 
+          throw Exception();
+        memcpy( e->_snapshot.dict, dict, n );
+        e->_snapshot.dictlen = (unsigned) n;
+    } }
+    if ( !_streaming ) {
+      p = s.get( &n );
+      c->_len = 0;
+      c->reserve( n + StreamEntry::WindowSize );
+      memcpy( c->_block, p, n );
+      c->_len = n;
+    }
+    if ( e->_delegate ) 
+      e->_delegate -> resumeFile( e->_file, e->_window? 
+                                  e->_produced + e->_skip : e->_consumed );
+} }
+
+
+/**
+ *  Stream::scan scans the given data for a zip file in a zip archive. If
+ *  a complete file could be found, the File is passed to the StreamDelegate.
+ *  Files lying completely in the given data are decompressed in place, 
+ *  only files crossing the end of the data are copied to the Buffer.
+ *  Deflated files using a data descriptor are decompressed as the data 
+ *  arrives (by a StreamEntry) until the end of the deflated stream.
+ *  In streaming mode only the Header of a file is stored in the Buffer, 
+ *  the contents of all files (but stored files using a data descriptor) 
+ *  is decompressed as it arrives.
+ */
+
+void Stream::scan( const char *buff, int blen ) {
+  Buffer *b = (Buffer *) _buffer;
+  Timer total( _timing, &_stats.scan );
+  while ( blen > 0 ) {
+    StreamEntry *e = (StreamEntry *) _entry;
+    int bufflen = blen;
+    if ( e ) {
+      if ( !e->isDone() ) {
+        Timer t( _timing, &_stats.decode, &_stats.delegate );
+        int n = e->process( (const tByte *) buff, bufflen );
+        buff += n;
+        bufflen -= n;
+        _stats.bytesDirect += n;
+      }
+      else {
+        b->addDescriptor( &buff, &bufflen );
+        if ( b->fileFound() ) e->setDataDescriptor( b->dataDescriptor() );
+    } }
+    else {
+      if ( !_streaming && b->isIdle() ) {
+        const Header *h = 
+          b->findInPlace( (const tByte **) &buff, &bufflen );
+        if ( h ) {
+          int fsize = h->hsize() + h->csize();
+          int filter = accept( h );
+          const tByte *contents = (const tByte *) buff + h->hsize();
+          bool spill = exceedsLimit( h );
+          FilePtr f;
+          if ( (filter != StreamDelegate::Skip) && !spill ) {
+            Timer t( _timing, &_stats.decode );
+            f.reset( new File( h, contents, _inflater, _pool, 
+                               filter == StreamDelegate::DataOnly ) );
+          }
+          _stats.bytesDirect += fsize;
+          buff += fsize;
+          bufflen -= fsize;
+          _bytes_read += (blen - bufflen);
+          blen = bufflen;
+          if ( f ) _delegate -> handleFile( std::move( f ) );
+          else if ( spill && (filter != StreamDelegate::Skip) ) {
+            // large files are passed via the Collector to a Spill
+            Timer t( _timing, &_stats.decode, &_stats.delegate );
+            StreamEntry e( h, 1, (Collector *) _collector, 
+                           (Inflater *) _inflater, filter );
+            while ( !e.isDone() ) contents += e.process( contents, 1 << 30 );
+            e.finish();
+          }
+          continue;
+      } }
+      if ( !b->isCompleteHeader() ) {
+        b->addHeader( &buff, &bufflen );
+        if ( b->isCompleteHeader() ) {
+          Header *h = b->header();
+          StreamDelegate *d = _streaming? _delegate : (Collector *) _collector;
+          _filter = accept( h );
+          if ( !h->hasSize() && (h->compression() == Header::Deflated) )
+            _entry = new StreamEntry( h, 0, d, (Inflater *) _inflater, 
+                                      _filter );
+          else if ( h->hasSize() && (_streaming || exceedsLimit( h ) ||
+                                     (_filter != StreamDelegate::Accept)) )
+            _entry = new StreamEntry( h, 1, d, (Inflater *) _inflater, 
+                                      _filter );
+          else if ( _filter == StreamDelegate::Skip ) b->discard();
+      } }
+      else {
+        b->addData( &buff, &bufflen );
+        if ( b->fileFound() ) {
+          Rope &r = b->_rope;
+          if ( _filter == StreamDelegate::Skip ) b->reset();
+          else if ( !_streaming && r._spill && 
+                    (_filter == StreamDelegate::Accept) &&
+                    (b->header()->compression() == Header::Stored) ) {
+            // the spilled data is the File's data
+            FilePtr f;
+            {
+              Timer t( _timing, &_stats.decode );
+              f = r._spill -> file( b->header(), false );
+              if ( crc32Update( 0, (const tByte *) f->data(), f->size() ) != 
+                   b->header()->crc32() )
+                throw Exception( "zip archive corrupt (CRC32 error)" );
+            }
+            b->reset();
+            _bytes_read += (blen - bufflen);
+            blen = bufflen;
+            _delegate -> handleFile( std::move( f ) );
+            continue;
+          }
+          else if ( _streaming || r._spill || 
+                    (_filter == StreamDelegate::DataOnly) ) {
+            StreamDelegate *d = 
+              _streaming? _delegate : (Collector *) _collector;
+            Timer t( _timing, &_stats.decode, &_stats.delegate );
+            _entry = e = new StreamEntry( b->header(), 1, d,
+                                          (Inflater *) _inflater, _filter );
+            r.forEach( [e]( const tByte *data, int len ) 
+              { e->process( data, len ); } );
+          }
+          else {
+            FilePtr f;
+            {
+              Timer t( _timing, &_stats.decode ); 
+              f.reset( new File( b, _inflater, _pool ) ); 
+            }
+            b->reset();
+            _bytes_read += (blen - bufflen);
+            blen = bufflen;
+            _delegate -> handleFile( std::move( f ) );
+            continue;
+    } } } }
+    _bytes_read += (blen - bufflen);
+    blen = bufflen;
+    e = (StreamEntry *) _entry;
+    if ( e && e->isDone() && (e->_sized || b->fileFound()) ) {
+      std::unique_ptr<StreamEntry> done( e );
+      Timer t( _timing, &_stats.decode, &_stats.delegate );
+      _entry = 0;
+      b->reset();
+      e->finish();
+  } }
+  ((Monitor *) _delegate) -> flush();
+}
+
+
+/**
+ *  A Queue is a bounded lock-free queue for a single producer and a single 
+ *  consumer thread. push waits while the queue is full, pop waits while it 
+ *  is empty. Both stop waiting (and return false) when the queue is closed.
+ *  A waiting thread spins and yields for a short while and then blocks on
+ *  a condition variable, so an idle pipeline doesn't use any CPU. The
+ *  other side takes the mutex only if a thread is blocked.
+ *  The time spent waiting is added to *waited (nanoseconds).
+ */
+
+template <class T> class Queue {
+
+  private:
+  std::vector<T>	_slots;		// ring buffer
+  unsigned		_mask;		// #slots - 1
+  std::atomic<unsigned>	_head;		// next slot to pop
+  std::atomic<unsigned>	_tail;		// next slot to push
+  std::atomic<bool>	_closed;	// queue has been closed
+  std::atomic<int>	_blocked;	// #threads waiting on _cond
+  std::mutex		_mutex;		// protects waiting on _cond
+  std::condition_variable _cond;	// signalled by push, pop and close
+
+  // waits until ready() returns true (false is returned if the queue has
+  // been closed before)
+  template <class F> bool wait( F ready, std::atomic<long long> *waited ) {
+    auto start = std::chrono::steady_clock::now();
+    int n = 0;
+    while ( !ready() && !_closed ) {
+      if ( ++n < 64 ) continue;
+      if ( n < 128 ) { std::this_thread::yield(); continue; }
+      std::unique_lock<std::mutex> lock( _mutex );
+      // the updates of _blocked here and in wake are ordered: either wake
+      // sees this thread blocked or ready() sees the change wake reports
+      _blocked.fetch_add( 1, std::memory_order_acq_rel );
+      _cond.wait( lock, [&]() { return ready() || _closed; } );
+      _blocked--;
+    }
+    *waited += std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start ).count();
+    return ready();
+  }
+
+  // wakes the thread blocked in wait (if any)
+  void wake( void ) {
+    if ( _blocked.fetch_add( 0, std::memory_order_acq_rel ) ) {
+      std::lock_guard<std::mutex> lock( _mutex );
+      _cond.notify_all();
+  } }
+
+  public:
+  Queue( int depth ) 
+    : _head( 0 ), _tail( 0 ), _closed( false ), _blocked( 0 ) {
+    unsigned n = 2;
+    while ( n < (unsigned) depth ) n <<= 1;
+    _slots.resize( n );
+    _mask = n - 1;
+  }
+
+  void close( void ) { _closed = true; wake(); }
+
+  bool push( const T &val, std::atomic<long long> *waited ) {
+    unsigned tail = _tail.load( std::memory_order_relaxed );
+    auto room = [&]() { 
+      return tail - _head.load( std::memory_order_acquire ) <= _mask; 
+    };
+    if ( !room() && !wait( room, waited ) ) return false;
+    _slots[tail & _mask] = val;
+    _tail.store( tail + 1, std::memory_order_release );
+    wake();
+    return true;
+  }
+
+  bool pop( T &val, std::atomic<long long> *waited ) {
+    unsigned head = _head.load( std::memory_order_relaxed );
+    auto filled = [&]() { 
+      return head != _tail.load( std::memory_order_acquire ); 
+    };
+    if ( !filled() && !wait( filled, waited ) ) return false;
+    val = _slots[head & _mask];
+    _head.store( head + 1, std::memory_order_release );
+    wake();
+    return true;
+  }
+
+}; // class Queue
+
+
+/**
+ *  A Pipeline connects the three stages of a PipelinedStream: the 
+ *  receiving thread (PipelinedStream::scan) passes copies of the received 
+ *  data via _chunks to the scanning thread. The scanning thread runs 
+ *  Stream::scan and passes the Files found via _files to the handling 
+ *  thread which calls the delegate. If _stream batches Files, a Batch
+ *  carries the Files passed to handleFiles (allocated by new[]), otherwise
+ *  a single File. An empty Chunk resp. Batch marks the end of data.
+ */
+
+class Pipeline : public StreamDelegate {
+
+  public:
+  struct Chunk { char *data; int len; };
+  struct Batch { File *file; FilePtr *files; int n; };
+
+  StreamDelegate	*_delegate;	// delegate to pass Files to
+  Stream		 _stream;	// Stream used by the scanning thread
+  Queue<Chunk>		 _chunks;	// received data
+  Queue<Batch>		 _files;	// Files found
+  std::thread		 _scanner;	// scanning thread
+  std::thread		 _handler;	// handling thread
+  std::exception_ptr	 _error;	// first Exception thrown
+  std::atomic<bool>	 _failed;	// an Exception has been thrown
+  std::mutex		 _mutex;	// protects _error
+  struct {
+    std::atomic<long long> receive, receiveStalled, scan, scanIdle, 
+                           scanStalled, handle, handleIdle;
+  }			 _times;	// per stage timings (see times())
+  std::atomic<long>	 _bytes_read;	// bytes scanned so far
+
+  Pipeline( StreamDelegate &delegate, int depth );
+  ~Pipeline();
+
+  // stops the pipeline after an Exception
+  void fail( void );
+
+  // called by _stream in the scanning thread
+  int acceptFile( const File *file ) { return _delegate -> acceptFile( file ); }
+  void handleFile( FilePtr file );
+  void handleFiles( FilePtr *files, int n );
+
+  // deletes the Files of a Batch
+  static void clear( Batch &b );
+
+  // the scanning and handling thread
+  void scanning( void );
+  void handling( void );
+
+}; // class Pipeline
+
+static long long nsSince( std::chrono::steady_clock::time_point start ) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>( 
+    std::chrono::steady_clock::now() - start ).count();
+}
+
+Pipeline::Pipeline( StreamDelegate &delegate, int depth )
+  : _delegate( &delegate ), _stream( *this ), _chunks( depth ), 
+    _files( depth ), _failed( false ), _bytes_read( 0 ) {
+  _times.receive = _times.receiveStalled = _times.scan = 0;
+  _times.scanIdle = _times.scanStalled = 0;
+  _times.handle = _times.handleIdle = 0;
+  _scanner = std::thread( &Pipeline::scanning, this );
+  _handler = std::thread( &Pipeline::handling, this );
+}
+
+Pipeline::~Pipeline() {
+  Chunk c;
+  Batch f;
+  std::atomic<long long> dummy( 0 );
+  _chunks.close();
+  _files.close();
+  if ( _scanner.joinable() ) _scanner.join();
+  if ( _handler.joinable() ) _handler.join();
+  while ( _chunks.pop( c, &dummy ) ) if ( c.data ) free( c.data );
+  while ( _files.pop( f, &dummy ) ) clear( f );
+}
+
+void Pipeline::clear( Batch &b ) {
+  if ( b.file ) delete b.file;
+  if ( b.files ) delete[] b.files;
+  b.file = 0; b.files = 0; b.n = 0;
+}
+
+void Pipeline::fail( void ) {
+  std::lock_guard<std::mutex> lock( _mutex );
+  if ( !_error ) _error = std::current_exception();
+  _failed = true;
+  _chunks.close();
+  _files.close();
+}
+
+void Pipeline::handleFile( FilePtr file ) {
+  Batch b = { file.release(), 0, 0 };
+  if ( !_files.push( b, &_times.scanStalled ) ) clear( b );
+}
+
+void Pipeline::handleFiles( FilePtr *files, int n ) {
+  Batch b = { 0, new FilePtr[n], n };
+  for ( int i = 0; i < n; i++ ) b.files[i] = std::move( files[i] );
+  if ( !_files.push( b, &_times.scanStalled ) ) clear( b );
+}
+
+void Pipeline::scanning( void ) {
+  Chunk c;
+  try {
+    while ( _chunks.pop( c, &_times.scanIdle ) && c.data ) {
+      auto start = std::chrono::steady_clock::now();
+      try { _stream.scan( c.data, c.len ); }
+      catch ( ... ) { free( c.data ); throw; }
+      free( c.data );
+      _bytes_read = _stream.bytesRead();
+      _times.scan += nsSince( start );
+    }
+    Batch end = { 0, 0, 0 };
+    _files.push( end, &_times.scanStalled );
+  }
+  catch ( ... ) { fail(); }
+}
+
+void Pipeline::handling( void ) {
+  Batch b;
+  try {
+    while ( _files.pop( b, &_times.handleIdle ) && (b.file || b.files) ) {
+      auto start = std::chrono::steady_clock::now();
+      if ( b.file ) _delegate -> handleFile( FilePtr( b.file ) );
+      else {
+        std::unique_ptr<FilePtr[]> files( b.files );
+        _delegate -> handleFiles( files.get(), b.n );
+      }
+      _times.handle += nsSince( start );
+  } }
+  catch ( ... ) { fail(); }
+}
+
+
+/**
+ *  The PipelinedStream constructor starts the scanning and handling thread.
+ */
+
+PipelinedStream::PipelinedStream( StreamDelegate &delegate, int depth ) {
+  _pipeline = new Pipeline( delegate, depth );
+}
+
+
+/**
+ *  The PipelinedStream destructor stops the pipeline without waiting for
+ *  pending data to be processed (use finish() to wait).
+ */
+
+PipelinedStream::~PipelinedStream() {
+  if ( _pipeline ) delete (Pipeline *) _pipeline;
+  _pipeline = 0;
+}
+
+
+/**
+ *  PipelinedStream::setBatching lets the scanning thread pass batches of 
+ *  Files (see Stream::setBatching) to the handling thread, which calls 
+ *  StreamDelegate::handleFiles. It must be called before scan.
+ */
+
+void PipelinedStream::setBatching( int files, long bytes ) {
+  ((Pipeline *) _pipeline) -> _stream.setBatching( files, bytes );
+}
+
+
+/**
+ *  PipelinedStream::scan copies the given data and passes it to the 
+ *  scanning thread. If depth chunks are waiting to be scanned, scan waits 
+ *  until the scanning thread has caught up.
+ */
+
+void PipelinedStream::scan( const char *buff, int bufflen ) {
+  Pipeline *p = (Pipeline *) _pipeline;
+  if ( bufflen <= 0 ) return;
+  if ( p->_failed ) finish();
+  auto start = std::chrono::steady_clock::now();
+  Pipeline::Chunk c;
+  if ( !(c.data = (char *) malloc( bufflen )) ) throw Exception();
+  memcpy( c.data, buff, bufflen );
+  c.len = bufflen;
+  p->_times.receive += nsSince( start );
+  if ( !p->_chunks.push( c, &p->_times.receiveStalled ) ) {
+    free( c.data );
+    finish();
+} }
+
+
+/**
+ *  PipelinedStream::finish waits until all data given to scan has been 
+ *  scanned and all Files found have been handled. An Exception thrown in
+ *  the scanning or handling thread is rethrown.
+ */
+
+void PipelinedStream::finish( void ) {
+  Pipeline *p = (Pipeline *) _pipeline;
+  std::atomic<long long> dummy( 0 );
+  Pipeline::Chunk end = { 0, 0 };
+  p->_chunks.push( end, &dummy );
+  if ( p->_scanner.joinable() ) p->_scanner.join();
+  if ( p->_handler.joinable() ) p->_handler.join();
+  if ( p->_error ) std::rethrow_exception( p->_error );
+}
+
+
+/**
+ *  PipelinedStream::bytesRead returns the #bytes scanned so far.
+ */
+
+long PipelinedStream::bytesRead( void ) const {
+  return ((Pipeline *) _pipeline) -> _bytes_read;
+}
+
+
+/**
+ *  PipelinedStream::times returns the time spent in the pipeline stages so
+ *  far, it may be called while the stages are running.
+ */
+
+PipelineTimes PipelinedStream::times( void ) const {
+  Pipeline *p = (Pipeline *) _pipeline;
+  PipelineTimes t = { p->_times.receive, p->_times.receiveStalled, 
+    p->_times.scan, p->_times.scanIdle, p->_times.scanStalled, 
+    p->_times.handle, p->_times.handleIdle };
+  return t;
+}
+
+
+/**
+ *  A ReaderState is the StreamDelegate of the Stream of a Reader. It queues
+ *  the Events of a slice of input, the data passed to handleData is copied
+ *  since it is only valid during the call. The Files of the Events are 
+ *  copies of the Stream's Files (Header and name only), which are deleted
+ *  by the Stream after endFile.
+ */
+
+class ReaderState : public StreamDelegate {
+
+  public:
+  Stream		 _stream;	// Stream in streaming mode
+  const tByte		*_in;		// input not yet scanned
+  int			 _inlen;	// #bytes at _in
+  int			 _slice;	// #bytes scanned per slice
+  std::vector<Reader::Event> _events;	// Events of the last slice
+  std::vector<long>	 _offsets;	// offset of Event data in _data
+  std::vector<tByte>	 _data;		// data of Events
+  size_t		 _next;		// next Event to return
+  FilePtr		 _current;	// copy of File being streamed
+  std::vector<FilePtr>	 _ended;	// Files of End Events
+
+  ReaderState( int slice ) : _stream( *this ) {
+    _stream.setStreaming();
+    _in = 0; _inlen = 0; _next = 0;
+    _slice = (slice > 0)? slice : Reader::Slice;
+  }
+
+  // queues an Event of the current File
+  void push( int type, const void *data = 0, int len = 0, bool ok = true ) {
+    Reader::Event e = { type, _current.get(), 0, len, ok };
+    _events.push_back( e );
+    _offsets.push_back( (long) _data.size() );
+    if ( len > 0 ) 
+      _data.insert( _data.end(), (const tByte *) data, 
+                    (const tByte *) data + len );
+  }
+
+  // drops the Events returned (keeping the buffers)
+  void clear( void ) {
+    _events.clear();
+    _offsets.clear();
+    _data.clear();
+    _ended.clear();
+    _next = 0;
+  }
+
+  void beginFile( const File *file ) {
+    _current.reset( new File( file->header(), 0, 0, 0, file->isRaw() ) );
+    push( Reader::Begin );
+  }
+
+  void handleData( const File *, const void *data, int len ) {
+    push( Reader::Data, data, len );
+  }
+
+  // the Header may have been completed by a data descriptor
+  void endFile( const File *file, bool crcOk ) {
+    memcpy( _current->header(), file->header(), 
+            ((const Header *) file->header()) -> hsize() );
+    push( Reader::End, 0, 0, crcOk );
+    _ended.push_back( std::move( _current ) );
+  }
+
+}; // class ReaderState
+
+
+/**
+ *  The Reader constructor creates a Reader scanning the data fed in 
+ *  slices of the given size.
+ */
+
+Reader::Reader( int slice ) {
+  _state = new ReaderState( slice );
+}
+
+
+/**
+ *  The Reader destructor deletes the Stream and all Events.
+ */
+
+Reader::~Reader() {
+  delete (ReaderState *) _state;
+}
+
+
+/**
+ *  Reader::feed passes the next len bytes of the zip archive, they are not
+ *  copied and must stay valid until 'next' returns 0.
+ */
+
+void Reader::feed( const void *data, int len ) {
+  ReaderState *s = (ReaderState *) _state;
+  if ( s->_inlen > 0 ) 
+    throw Exception( "Reader::feed called before all data has been read" );
+  s->_in = (const tByte *) data;
+  s->_inlen = (len > 0)? len : 0;
+}
+
+
+/**
+ *  Reader::next returns the next Event found in the data fed, 0 is 
+ *  returned if all data has been scanned and more is needed. The next 
+ *  slice of data is scanned only when the Events of the previous one 
+ *  have been returned.
+ */
+
+const Reader::Event *Reader::next( void ) {
+  ReaderState *s = (ReaderState *) _state;
+  while ( s->_next >= s->_events.size() ) {
+    s->clear();
+    if ( s->_inlen <= 0 ) return 0;
+    int n = std::min( s->_inlen, s->_slice );
+    s->_stream.scan( (const char *) s->_in, n );
+    s->_in += n;
+    s->_inlen -= n;
+    // _data doesn't move anymore until the Events have been returned
+    for ( size_t i = 0; i < s->_events.size(); i++ )
+      if ( s->_events[i].len > 0 ) 
+        s->_events[i].data = s->_data.data() + s->_offsets[i];
+  }
+  return &s->_events[s->_next++];
+}
+
+
+/**
+ *  Reader::needsInput returns true if all Events of the data fed have been
+ *  returned.
+ */
+
+bool Reader::needsInput( void ) const {
+  ReaderState *s = (ReaderState *) _state;
+  return (s->_inlen <= 0) && (s->_next >= s->_events.size());
+}
+
+
+/**
+ *  Reader::bytesRead returns the #bytes scanned so far.
+ */
+
+long Reader::bytesRead( void ) const {
+  return ((ReaderState *) _state) -> _stream.bytesRead();
+}
+
+
+/**
+ *  isSafeName returns false for absolute file names and names containing 
+ *  a ".." component (which would be written outside the destination).
+ */
+
+static bool isSafeName( const char *name ) {
+  if ( name[0] == '/' ) return false;
+  for ( const char *p = name; *p; ) {
+    const char *e = strchr( p, '/' );
+    size_t n = e? (size_t)(e - p) : strlen( p );
+    if ( (n == 2) && (p[0] == '.') && (p[1] == '.') ) return false;
+    if ( !e ) break;
+    p = e + 1;
+  }
+  return true;
+}
+
+
+class AccessIndex;
+
+/**
+ *  A Directory is the index of the files in an Archive built from the 
+ *  central directory.
+ */
+
+class Directory {
+
+  public:
+  std::vector<const DirHeader *> _entries;		// central dir headers
+  std::unordered_map<std::string, int> _index;	// name -> entry index
+  std::string	 _path;		// path of archive
+  AccessIndex	*_access;	// index of large deflated files (or 0)
+
+  // parses the central directory of the archive in [base, base+size)
+  Directory( const tByte *base, long size );
+  ~Directory();
+
+}; // class Directory
+
+Directory::Directory( const tByte *base, long size ) {
+  const tByte *end = base + size, *p;
+  _access = 0;
+  if ( size < (long) sizeof(EndOfDir) )
+    throw Exception( "zip archive corrupt (no end of central directory)" );
+  // search end of central directory record backwards, its comment 
+  // may be up to 64k long
+  p = end - sizeof(EndOfDir);
+  const tByte *stop = (size > 0xffff + (long) sizeof(EndOfDir))? 
+    end - 0xffff - sizeof(EndOfDir) : base;
+  while ( (p >= stop) && memcmp( p, EndOfDir::signature, 4 ) ) p--;
+  if ( p < stop )
+    throw Exception( "zip archive corrupt (no end of central directory)" );
+  const EndOfDir *eod = (const EndOfDir *) p;
+  if ( eod->isZip64() ) throw Exception( "zip64 archives are not supported" );
+  if ( (long) eod->diroffset() + (long) eod->dirsize() > (long)(p - base) )
+    throw Exception( "zip archive corrupt (central directory)" );
+  p = base + eod->diroffset();
+  const tByte *dend = p + eod->dirsize();
+  unsigned n = eod->nentries();
+  _entries.reserve( n );
+  _index.reserve( n );
+  for ( unsigned i = 0; i < n; i++ ) {
+    const DirHeader *dh = (const DirHeader *) p;
+    if ( (dend - p < (long) sizeof(DirHeader)) ||
+         memcmp( p, DirHeader::signature, 4 ) || (dend - p < dh->hsize()) )
+      throw Exception( "zip archive corrupt (central directory)" );
+    _index.emplace( std::string( dh->filename(), dh->fnlength() ),
+                    (int) _entries.size() );
+    _entries.push_back( dh );
+    p += dh->hsize();
+} }
+
+
+/**
+ *  The Archive constructor maps the given zip archive into memory and 
+ *  reads its central directory.
+ */
+
+Archive::Archive( const char *path ) {
+  struct stat st;
+  _map = 0; _size = 0; _dir = 0;
+  if ( (_fd = open( path, O_RDONLY )) < 0 )
+    throw Exception( "can't open zip archive" );
+  if ( fstat( _fd, &st ) < 0 ) { close( _fd ); throw Exception(); }
+  _size = (long) st.st_size;
+  if ( _size > 0 ) {
+    _map = mmap( 0, _size, PROT_READ, MAP_PRIVATE, _fd, 0 );
+    if ( _map == MAP_FAILED ) { 
+      _map = 0; close( _fd ); 
+      throw Exception( "can't map zip archive" ); 
+  } }
+  try { 
+    _dir = new Directory( (const tByte *) _map, _size ); 
+    ((Directory *) _dir) -> _path = path;
+  }
+  catch ( ... ) {
+    if ( _map ) munmap( _map, _size );
+    close( _fd );
+    throw;
+} }
+
+
+/**
+ *  The Archive destructor unmaps the archive.
+ */
+
+Archive::~Archive() {
+  if ( _dir ) delete (Directory *) _dir;
+  if ( _map ) munmap( _map, _size );
+  if ( _fd >= 0 ) close( _fd );
+  _dir = _map = 0;
+  _fd = -1;
+}
+
+
+/**
+ *  Archive::count returns the number of files in the archive.
+ */
+
+int Archive::count( void ) const {
+  return (int) ((Directory *) _dir) -> _entries.size();
+}
+
+
+/**
+ *  Archive::find returns the index of the file with the given name or -1.
+ */
+
+int Archive::find( const char *name ) const {
+  Directory *d = (Directory *) _dir;
+  auto it = d->_index.find( name );
+  return (it == d->_index.end())? -1 : it->second;
+}
+
+
+/**
+ *  Archive::name returns the (allocated) name of the file at index i.
+ */
+
+char *Archive::name( int i ) const {
+  Directory *d = (Directory *) _dir;
+  if ( (i < 0) || (i >= count()) ) return 0;
+  const DirHeader *dh = d->_entries[i];
+  int l = dh->fnlength();
+  char *ret = (char *) malloc( (l+1) * sizeof(char) );
+  if ( ret ) {
+    memcpy( ret, dh->filename(), l * sizeof(char) );
+    ret[l] = '\0';
+  }
+  return ret;
+}
+
+
+/**
+ *  localHeader returns the local header of the file at index i of the
+ *  Directory d of the archive mapped at [base, base+size), the compressed
+ *  contents follow the header. Sizes, CRC and compression method of a 
+ *  local header must match the central directory, since only the latter 
+ *  are checked against the size of the archive. Stored files must have
+ *  equal sizes, otherwise copying them would read beyond their contents.
+ */
+
+static const Header *localHeader( const Directory *d, const tByte *base, 
+                                  long size, int i ) {
+  const DirHeader *dh = d->_entries[i];
+  const Header *h = (const Header *) (base + dh->offset());
+  if ( (size - (long) dh->offset() < (long) sizeof(Header)) ||
+       memcmp( h, Header::signature, 4 ) ||
+       (size - (long) dh->offset() < (long) h->hsize() + (long) dh->csize()) ||
+       (h->compression() != dh->compression()) ||
+       ((dh->compression() == Header::Stored) && 
+        (dh->csize() != dh->size())) ||
+       (h->hasSize() && ((h->csize() != dh->csize()) || 
+                         (h->size() != dh->size()) || 
+                         (h->crc32() != dh->crc32()))) )
+    throw Exception( "zip archive corrupt (local header)" );
+  return h;
+}
+
+
+/**
+ *  extractFile decompresses the file at index i of the Directory d of the
+ *  archive mapped at [base, base+size) using the given Inflater (or a 
+ *  temporary one if 0).
+ */
+
+static FilePtr extractFile( const Directory *d, const tByte *base, long size,
+                            int i, Inflater *inflater ) {
+  if ( (i < 0) || (i >= (int) d->_entries.size()) ) return 0;
+  const DirHeader *dh = d->_entries[i];
+  const Header *h = localHeader( d, base, size, i );
+  const tByte *contents = ((const tByte *) h) + h->hsize();
+  if ( h->hasSize() ) return FilePtr( new File( h, contents, inflater ) );
+  // sizes and CRC are taken from the central directory
+  Header *lh = (Header *) malloc( h->hsize() );
+  if ( !lh ) throw Exception();
+  memcpy( lh, h, h->hsize() );
+  lh->setSizes( dh );
+  FilePtr f;
+  try { f.reset( new File( lh, contents, inflater ) ); }
+  catch ( ... ) { free( lh ); throw; }
+  free( lh );
+  return f;
+}
+
+
+/**
+ *  Archive::extract decompresses the file at index i directly from the 
+ *  mapped archive (0: no such file).
+ */
+
+FilePtr Archive::extract( int i ) const {
+  return extractFile( (Directory *) _dir, (const tByte *) _map, _size, i, 0 );
+}
+
+
+/**
+ *  Archive::extract decompresses the file with the given name, 0 is 
+ *  returned if there is no such file.
+ */
+
+FilePtr Archive::extract( const char *name ) const {
+  return extract( find( name ) );
+}
+
+
+/**
+ *  parallel calls job(i, inflater) for the indices of all n files of an 
+ *  archive using nthreads threads (0: #cores), every thread uses its own
+ *  Inflater. The files are handed out largest first
+ *  (by compressed size) to the next idle thread, so a single huge file 
+ *  doesn't leave the other threads waiting at the end. The first Exception 
+ *  thrown by a job stops the remaining threads and is rethrown.
+ */
+
+static void parallel( const Directory *d, int nthreads, 
+                      const std::function<void (int, Inflater *)> &job ) {
+  int n = (int) d->_entries.size();
+  std::vector<int> order( n );
+  for ( int i = 0; i < n; i++ ) order[i] = i;
+  std::sort( order.begin(), order.end(), [d]( int a, int b ) {
+    return d->_entries[a]->csize() > d->_entries[b]->csize();
+  });
+  if ( nthreads <= 0 ) nthreads = (int) std::thread::hardware_concurrency();
+  if ( nthreads <= 0 ) nthreads = 1;
+  if ( nthreads > n ) nthreads = n;
+  std::atomic<int> next( 0 );
+  std::atomic<bool> failed( false );
+  std::exception_ptr error;
+  std::mutex mutex;
+  auto worker = [&]() {
+    Inflater inflater;
+    int i;
+    while ( !failed && ((i = next++) < n) ) {
+      try { job( order[i], &inflater ); }
+      catch ( ... ) {
+        std::lock_guard<std::mutex> lock( mutex );
+        if ( !failed ) { error = std::current_exception(); failed = true; }
+  } } };
+  std::vector<std::thread> threads;
+  for ( int t = 1; t < nthreads; t++ ) threads.emplace_back( worker );
+  worker();
+  for ( auto &t: threads ) t.join();
+  if ( error ) std::rethrow_exception( error );
+}
+
+
+/**
+ *  Archive::extract decompresses all files of the archive using nthreads
+ *  threads (0: #cores) and passes them to delegate.handleFile. handleFile
+ *  is called concurrently from all threads and must be thread safe.
+ */
+
+void Archive::extract( StreamDelegate &delegate, int nthreads ) const {
+  Directory *d = (Directory *) _dir;
+  parallel( d, nthreads, [&]( int i, Inflater *inflater ) {
+    delegate.handleFile( 
+      extractFile( d, (const tByte *) _map, _size, i, inflater ) );
+  });
+}
+
+
+/**
+ *  Archive::extractTo decompresses all files of the archive using nthreads 
+ *  threads (0: #cores) and writes them to the given directory.
+ */
+
+void Archive::extractTo( const char *dir, int nthreads ) const {
+  // an archive with names leading outside dir is rejected as a whole 
+  // before anything is written
+  for ( const DirHeader *dh: ((Directory *) _dir) -> _entries )
+    if ( !isSafeName( std::string( dh->filename(), dh->fnlength() ).c_str() ) )
+      throw Exception( "invalid file name in zip archive" );
+  Extractor extractor( dir );
+  extract( extractor, nthreads );
+}
+
+
+/**
+ *  An AccessIndex allows to read ranges of large deflated files of an
+ *  Archive without inflating them from their start. For every indexed file
+ *  it holds a sequence of access points at deflate block boundaries about
+ *  'span' bytes of output apart. A Point records the positions in the 
+ *  compressed and uncompressed data and the last 32K of output, which is
+ *  the window the following blocks may refer back into. The index file
+ *  is written by AccessIndex::build in host byte order (it is meant to be 
+ *  used on the device it has been built on) and mapped into memory by the
+ *  constructor. It consists of a Head, an Entry per indexed file and the
+ *  Points of all files.
+ */
+
+class AccessIndex {
+
+  public:
+  enum { Magic = 0x7864697a, Version = 1 };	// "zidx"
+
+  struct Head {
+    unsigned	 magic;		// Magic
+    unsigned	 version;	// Version
+    long long	 asize;		// size of archive
+    long long	 nfiles;	// #Entries following
+  };
+
+  struct Entry {
+    long long	 index;		// index of file in archive
+    long long	 offset;	// offset of local header in archive
+    long long	 csize;		// compressed size
+    long long	 size;		// uncompressed size
+    long long	 crc;		// CRC-32 of uncompressed data
+    long long	 npoints;	// #Points of file
+    long long	 points;	// offset of first Point in index file
+  };
+
+  struct Point {
+    long long	 out;		// offset in uncompressed data
+    long long	 in;		// offset in compressed data
+    int		 bits;		// #bits of byte at in-1 not yet consumed
+    int		 dictlen;	// length of window
+    tByte	 window[32*1024]; // output preceding 'out'
+  };
+
+  void		*_map;		// mapped index file
+  long		 _size;		// size of index file
+  std::unordered_map<int, const Entry *> _files; // archive index -> Entry
+
+  // maps the index file at path and checks it against the Directory d of 
+  // an archive of asize bytes
+  AccessIndex( const char *path, const Directory *d, long asize );
+  ~AccessIndex() { if ( _map ) munmap( _map, _size ); }
+
+  // returns the last Point at or before offset of file i (0: none)
+  const Point *find( int i, long offset ) const;
+
+  // writes the index of the deflated files of at least minSize bytes of
+  // the archive mapped at [base, base+asize) to path
+  static void build( const char *path, const Directory *d, 
+                     const tByte *base, long asize, long span, long minSize );
+
+}; // class AccessIndex
+
+AccessIndex::AccessIndex( const char *path, const Directory *d, long asize ) {
+  struct stat st;
+  int fd;
+  _map = 0; _size = 0;
+  if ( (fd = open( path, O_RDONLY )) < 0 )
+    throw Exception( "can't open index file" );
+  if ( (fstat( fd, &st ) < 0) || (st.st_size < (off_t) sizeof(Head)) ) {
+    close( fd );
+    throw Exception( "index file corrupt" );
+  }
+  _size = (long) st.st_size;
+  _map = mmap( 0, _size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( _map == MAP_FAILED ) { _map = 0; throw Exception( "can't map file" ); }
+  const Head *head = (const Head *) _map;
+  bool ok = (head->magic == Magic) && (head->version == Version) &&
+    (head->asize == asize) && (head->nfiles >= 0) &&
+    (head->nfiles <= (long long) ((_size - sizeof(Head)) / sizeof(Entry)));
+  const Entry *e = (const Entry *) (head + 1);
+  for ( long long k = 0; ok && (k < head->nfiles); k++, e++ ) {
+    const DirHeader *dh = ((e->index >= 0) && 
+      (e->index < (long long) d->_entries.size()))? d->_entries[e->index] : 0;
+    ok = dh && (dh->compression() == Header::Deflated) &&
+      (e->offset == dh->offset()) && (e->csize == dh->csize()) &&
+      (e->size == dh->size()) && (e->crc == dh->crc32()) &&
+      (e->points >= 0) && (e->points <= _size) && 
+      (e->points % sizeof(long long) == 0) && (e->npoints >= 0) &&
+      (e->npoints <= (long long) ((_size - e->points) / sizeof(Point)));
+    if ( ok ) _files[(int) e->index] = e;
+  }
+  if ( !ok ) {
+    munmap( _map, _size );
+    _map = 0;
+    throw Exception( "index file doesn't match zip archive" );
+} }
+
+const AccessIndex::Point *AccessIndex::find( int i, long offset ) const {
+  auto it = _files.find( i );
+  if ( it == _files.end() ) return 0;
+  const Entry *e = it->second;
+  const Point *first = (const Point *) ((const tByte *) _map + e->points);
+  const Point *p = std::upper_bound( first, first + e->npoints, offset, 
+    []( long off, const Point &p ) { return off < p.out; } );
+  return (p == first)? 0 : p - 1;
+}
+
+void AccessIndex::build( const char *path, const Directory *d, 
+  const tByte *base, long asize, long span, long minSize ) {
+  std::vector<Entry> files;
+  for ( int i = 0; i < (int) d->_entries.size(); i++ ) {
+    const DirHeader *dh = d->_entries[i];
+    if ( (dh->compression() == Header::Deflated) && 
+         ((long) dh->size() >= minSize) ) {
+      Entry e = { i, dh->offset(), dh->csize(), dh->size(), dh->crc32(), 0, 0 };
+      files.push_back( e );
+  } }
+  // the index is written to a temporary file first, so that an existing
+  // index is replaced only by a complete one
+  std::string tmp = std::string( path ) + ".tmp";
+  int fd = open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  if ( fd < 0 ) throw Exception( "can't create index file" );
+  try {
+    long pos = sizeof(Head) + files.size() * sizeof(Entry);
+    if ( lseek( fd, pos, SEEK_SET ) != pos ) 
+      throw Exception( "can't write file" );
+    std::unique_ptr<Point> p( new Point() );
+    std::vector<tByte> buff( 64*1024 );
+    Inflater inflater;
+    for ( Entry &e: files ) {
+      const Header *h = localHeader( d, base, asize, (int) e.index );
+      z_stream *zs = inflater.begin();
+      zs->next_in = (tByte *) h + h->hsize();
+      zs->avail_in = (uInt) e.csize;
+      unsigned long crc = 0;
+      long last = 0;
+      int ret;
+      e.points = pos;
+      do {
+        zs->next_out = buff.data();
+        zs->avail_out = (uInt) buff.size();
+        // Z_BLOCK stops at every block boundary, a Point is not needed in
+        // the last block
+        ret = inflate( zs, (zs->data_type & 64)? Z_NO_FLUSH : Z_BLOCK );
+        if ( (ret != Z_OK) && (ret != Z_STREAM_END) ) 
+          inflateError( ((ret == Z_BUF_ERROR) && !zs->avail_in)? Z_OK : ret );
+        crc = crc32Update( crc, buff.data(), buff.size() - zs->avail_out );
+        if ( (ret == Z_OK) && ((zs->data_type & 192) == 128) &&
+             ((long) zs->total_out - last >= span) ) {
+          uInt dictlen = sizeof p->window;
+          if ( inflateGetDictionary( zs, p->window, &dictlen ) != Z_OK )
+            throw Exception( "libz: inflateGetDictionary failed" );
+          p->out = last = (long) zs->total_out;
+          p->in = e.csize - zs->avail_in;
+          p->bits = zs->data_type & 7;
+          p->dictlen = (int) dictlen;
+          writeAll( fd, p.get(), sizeof(Point) );
+          pos += sizeof(Point);
+          e.npoints++;
+      } } 
+      while ( ret != Z_STREAM_END );
+      if ( ((long long) zs->total_out != e.size) || ((long long) crc != e.crc) )
+        throw Exception( "zip archive corrupt (CRC32 error)" );
+    }
+    Head head = { Magic, Version, asize, (long long) files.size() };
+    if ( lseek( fd, 0, SEEK_SET ) != 0 ) throw Exception( "can't write file" );
+    writeAll( fd, &head, sizeof head );
+    writeAll( fd, files.data(), files.size() * sizeof(Entry) );
+    if ( close( fd ) ) { fd = -1; throw Exception( "can't write file" ); }
+    fd = -1;
+    if ( rename( tmp.c_str(), path ) ) 
+      throw Exception( "can't create index file" );
+  }
+  catch ( ... ) {
+    if ( fd >= 0 ) close( fd );
+    unlink( tmp.c_str() );
+    throw;
+} }
+
+Directory::~Directory() {
+  if ( _access ) delete _access;
+}
+
+
+/**
+ *  Archive::buildIndex writes an access index of the deflated files of at
+ *  least minSize bytes to path (0: the path of the archive + ".zidx") and 
+ *  loads it. Access points are recorded about every 'span' bytes of 
+ *  output, so that Archive::read inflates less than span bytes before the
+ *  requested range. Every point takes 32K in the index file.
+ */
+
+void Archive::buildIndex( const char *path, long span, long minSize ) {
+  Directory *d = (Directory *) _dir;
+  std::string ipath = path? std::string( path ) : d->_path + ".zidx";
+  if ( span <= 0 ) span = IndexSpan;
+  AccessIndex::build( ipath.c_str(), d, (const tByte *) _map, _size, span,
+                      minSize );
+  if ( !loadIndex( ipath.c_str() ) ) 
+    throw Exception( "can't load index file" );
+}
+
+
+/**
+ *  Archive::loadIndex loads the access index written by buildIndex from 
+ *  path (0: the path of the archive + ".zidx"). false is returned if there
+ *  is no such index or it doesn't match the archive.
+ */
+
+bool Archive::loadIndex( const char *path ) {
+  Directory *d = (Directory *) _dir;
+  std::string ipath = path? std::string( path ) : d->_path + ".zidx";
+  AccessIndex *index;
+  try { index = new AccessIndex( ipath.c_str(), d, _size ); }
+  catch ( Exception & ) { return false; }
+  if ( d->_access ) delete d->_access;
+  d->_access = index;
+  return true;
+}
+
+
+/**
+ *  inflateRange inflates len bytes at offset of the raw deflate stream 
+ *  [contents, contents+csize) to buff starting at the access point p 
+ *  (0: at the start of the stream). The number of bytes inflated is
+ *  returned.
+ */
+
+static long inflateRange( const tByte *contents, long csize, 
+  const AccessIndex::Point *p, long offset, tByte *buff, long len ) {
+  Inflater inflater;
+  z_stream *zs = inflater.begin();
+  long in = 0, out = 0, done = 0;
+  if ( p ) {
+    if ( (p->in > csize) || (p->bits < 0) || (p->bits > 7) || 
+         (p->bits && (p->in < 1)) || (p->dictlen < 0) || 
+         (p->dictlen > (int) sizeof p->window) || (p->out > offset) ||
+         (p->bits && (inflatePrime( zs, p->bits, 
+                                    contents[p->in - 1] >> (8 - p->bits) ) 
+                      != Z_OK)) ||
+         ((p->dictlen > 0) && (inflateSetDictionary( zs, p->window, 
+                                 (uInt) p->dictlen ) != Z_OK)) )
+      throw Exception( "index file corrupt" );
+    in = (long) p->in;
+    out = (long) p->out;
+  }
+  zs->next_in = (tByte *) contents + in;
+  zs->avail_in = (uInt) (csize - in);
+  tByte discard[16*1024];
+  while ( done < len ) {
+    // output before offset is inflated to discard
+    bool skip = out < offset;
+    long n = skip? std::min( offset - out, (long) sizeof discard ) :
+                   std::min( len - done, 1L << 30 );
+    zs->next_out = skip? discard : buff + done;
+    zs->avail_out = (uInt) n;
+    int ret = inflate( zs, Z_NO_FLUSH );
+    n -= zs->avail_out;
+    if ( skip ) out += n; else done += n;
+    if ( ret == Z_STREAM_END ) break;
+    if ( ret != Z_OK ) 
+      inflateError( ((ret == Z_BUF_ERROR) && !zs->avail_in)? Z_OK : ret );
+  }
+  return done;
+}
+
+
+/**
+ *  Archive::read copies up to len bytes at offset of the uncompressed file
+ *  at index i to buff and returns the number of bytes copied (-1: no such 
+ *  file). Stored files are copied from the mapped archive, deflated files
+ *  are inflated from the nearest access point (see buildIndex) or from 
+ *  their start if they are not indexed. read may be called concurrently.
+ */
+
+long Archive::read( int i, long offset, void *buff, long len ) const {
+  Directory *d = (Directory *) _dir;
+  if ( (i < 0) || (i >= count()) ) return -1;
+  const DirHeader *dh = d->_entries[i];
+  const Header *h = localHeader( d, (const tByte *) _map, _size, i );
+  const tByte *contents = ((const tByte *) h) + h->hsize();
+  long size = (long) dh->size();
+  if ( (offset < 0) || (offset >= size) || (len <= 0) ) return 0;
+  if ( len > size - offset ) len = size - offset;
+  switch ( dh->compression() ) {
+    case Header::Stored :
+      memcpy( buff, contents + offset, len );
+      return len;
+    case Header::Deflated : 
+      return inflateRange( contents, (long) dh->csize(), 
+        d->_access? d->_access->find( i, offset ) : 0, offset, 
+        (tByte *) buff, len );
+    default:
+      throw Exception( "unsupported compression" );
+} }
+
+
+/**
+ *  The FileSource constructor opens and maps the given zip archive. If it
+ *  can't be mapped, a buffer of 'window' bytes is allocated for pread.
+ *  The window is rounded up to 64K, so that windows start page aligned.
+ */
+
+FileSource::FileSource( const char *path, int window ) {
+  struct stat st;
+  _map = 0; _buff = 0; _size = 0;
+  if ( (window <= 0) || (window > (1 << 30)) ) window = Window;
+  _window = (window + 0xffff) & ~0xffff;
+  if ( (_fd = open( path, O_RDONLY )) < 0 )
+    throw Exception( "can't open zip archive" );
+  if ( fstat( _fd, &st ) < 0 ) { close( _fd ); throw Exception(); }
+  _size = (long) st.st_size;
+  if ( _size <= 0 ) return;
+  _map = mmap( 0, _size, PROT_READ, MAP_PRIVATE, _fd, 0 );
+  if ( _map != MAP_FAILED ) madvise( _map, _size, MADV_SEQUENTIAL );
+  else {
+    _map = 0;
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise( _fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#elif defined(F_RDAHEAD)
+    fcntl( _fd, F_RDAHEAD, 1 );
+#endif
+    long n = (_size < _window)? _size : _window;
+    if ( !(_buff = (char *) malloc( n )) ) { close( _fd ); throw Exception(); }
+} }
+
+
+/**
+ *  The FileSource destructor unmaps and closes the archive.
+ */
+
+FileSource::~FileSource() {
+  if ( _map ) munmap( _map, _size );
+  if ( _buff ) free( _buff );
+  if ( _fd >= 0 ) close( _fd );
+  _map = 0; _buff = 0;
+  _fd = -1;
+}
+
+
+/**
+ *  FileSource::feed passes the archive from the given offset to
+ *  stream.scan. The first window ends at a multiple of _window, the
+ *  kernel is asked to read the next window while the current one is
+ *  scanned.
+ */
+
+template <class S>
+void FileSource::feed( S &stream, long offset ) {
+  while ( offset < _size ) {
+    long n = _window - offset % _window;
+    if ( n > _size - offset ) n = _size - offset;
+    if ( _map ) {
+      char *p = (char *) _map + offset;
+      if ( offset + n < _size ) {
+        long next = _size - offset - n;
+        madvise( p + n, (next < _window)? next : _window, MADV_WILLNEED );
+      }
+      stream.scan( p, (int) n );
+    }
+    else {
+      ssize_t ret = pread( _fd, _buff, n, offset );
+      if ( ret < 0 && errno == EINTR ) continue;
+      if ( ret <= 0 ) throw Exception( "can't read zip archive" );
+      stream.scan( _buff, (int) ret );
+      n = ret;
+    }
+    offset += n;
+} }
+
+
+/**
+ *  FileSource::scan passes the archive from the given offset to the
+ *  Stream resp. PipelinedStream.
+ */
+
+void FileSource::scan( Stream &stream, long offset ) {
+  feed( stream, offset );
+}
+
+void FileSource::scan( PipelinedStream &stream, long offset ) {
+  feed( stream, offset );
+}
+
+
+/**
+ *  The ExtractorState holds the directory cache and the file currently 
+ *  written (in streaming mode) of an Extractor.
+ */
+
+struct ExtractorState {
+  std::string			 dir;		// destination directory
+  std::unordered_set<std::string> dirs;		// directories created
+  std::mutex			 mutex;		// protects dirs
+  std::string			 path;		// path of current file
+  int				 fd;		// current file (-1: none)
+  tByte				*chunk;		// aligned write buffer
+  long				 len;		// #bytes in chunk
+};
+
+
+/**
+ *  preallocate reserves size bytes of disk space for the file fd (without
+ *  changing the file's size), so the file system can allocate contiguous
+ *  blocks up front. Errors are ignored.
+ */
+
+static void preallocate( int fd, long size ) {
+  if ( size <= 0 ) return;
+#if defined(__APPLE__)
+  fstore_t fs = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, size, 0 };
+  if ( fcntl( fd, F_PREALLOCATE, &fs ) < 0 ) {
+    fs.fst_flags = F_ALLOCATEALL;
+    fcntl( fd, F_PREALLOCATE, &fs );
+  }
+#elif defined(__linux__)
+  fallocate( fd, FALLOC_FL_KEEP_SIZE, 0, size );
+#endif
+}
+
+
+/**
+ *  setModified sets the modification time of the file fd to that of the
+ *  given Header.
+ */
+
+static void setModified( int fd, const Header *h ) {
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1].tv_sec = h->modified();
+  times[1].tv_nsec = 0;
+  futimens( fd, times );
+}
+
+
+/**
+ *  The Extractor constructor takes the directory to write the files to.
+ */
+
+Extractor::Extractor( const char *dir ) {
+  ExtractorState *es = new ExtractorState;
+  es->dir = dir;
+  es->fd = -1;
+  es->len = 0;
+  es->chunk = 0;
+  _state = es;
+}
+
+Extractor::~Extractor() {
+  ExtractorState *es = (ExtractorState *) _state;
+  if ( es->fd >= 0 ) close( es->fd );
+  if ( es->chunk ) free( es->chunk );
+  delete es;
+  _state = 0;
+}
+
+
+/**
+ *  Extractor::path returns the path of the given File in the destination 
+ *  directory and creates the missing directories leading to it. Absolute
+ *  names and names containing ".." are rejected.
+ */
+
+std::string Extractor::path( const File *file ) {
+  ExtractorState *es = (ExtractorState *) _state;
+  const char *name = file->name();
+  if ( !isSafeName( name ) ) 
+    throw Exception( "invalid file name in zip archive" );
+  std::string path = es->dir + "/" + name;
+  size_t pos = path.rfind( '/' );
+  std::lock_guard<std::mutex> lock( es->mutex );
+  mkdirs( path.substr( 0, pos ) );
+  return path;
+}
+
+
+/**
+ *  Extractor::mkdirs creates the directory dir and its missing parents. 
+ *  The directories created (or found) are cached, so only the first file
+ *  in a directory costs system calls. es->mutex must be locked.
+ */
+
+void Extractor::mkdirs( const std::string &dir ) {
+  ExtractorState *es = (ExtractorState *) _state;
+  if ( dir.empty() || es->dirs.count( dir ) ) return;
+  if ( mkdir( dir.c_str(), 0777 ) && (errno != EEXIST) ) {
+    size_t pos = dir.rfind( '/' );
+    if ( (errno != ENOENT) || (pos == std::string::npos) || (pos == 0) )
+      throw Exception( "can't create directory" );
+    mkdirs( dir.substr( 0, pos ) );
+    if ( mkdir( dir.c_str(), 0777 ) && (errno != EEXIST) )
+      throw Exception( "can't create directory" );
+  }
+  es->dirs.insert( dir );
+}
+
+
+/**
+ *  Extractor::handleFile writes a complete File (with a single write). 
+ *  handleFile may be called concurrently.
+ */
+
+void Extractor::handleFile( FilePtr f ) {
+  std::string p = path( f.get() );
+  if ( p.back() == '/' ) return;
+  int fd = open( p.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+  if ( fd < 0 ) throw Exception( "can't create file" );
+  try {
+    preallocate( fd, f->size() );
+    writeAll( fd, f->data(), f->size() );
+    setModified( fd, (const Header *) f->header() );
+  }
+  catch ( ... ) { close( fd ); throw; }
+  close( fd );
+}
+
+
+/**
+ *  Extractor::beginFile creates the file (preallocated if the size is 
+ *  given in the Header) the following data is written to.
+ */
+
+void Extractor::beginFile( const File *file ) {
+  ExtractorState *es = (ExtractorState *) _state;
+  es->path = path( file );
+  es->len = 0;
+  if ( es->path.back() == '/' ) return;
+  es->fd = open( es->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+  if ( es->fd < 0 ) throw Exception( "can't create file" );
+  preallocate( es->fd, file->size() );
+  if ( !es->chunk && posix_memalign( (void **) &es->chunk, 4096, ChunkSize ) )
+    { es->chunk = 0; throw Exception(); }
+}
+
+
+/**
+ *  Extractor::handleData collects the data in a buffer of ChunkSize bytes
+ *  which is written when full (larger data is written directly).
+ */
+
+void Extractor::handleData( const File *, const void *data, int len ) {
+  ExtractorState *es = (ExtractorState *) _state;
+  if ( es->fd < 0 ) return;
+  const tByte *p = (const tByte *) data;
+  while ( len > 0 ) {
+    if ( (es->len == 0) && (len >= ChunkSize) ) {
+      writeAll( es->fd, p, len );
+      return;
+    }
+    int n = (ChunkSize - es->len < len)? (int)(ChunkSize - es->len) : len;
+    memcpy( es->chunk + es->len, p, n );
+    es->len += n;
+    p += n;
+    len -= n;
+    if ( es->len == ChunkSize ) {
+      writeAll( es->fd, es->chunk, es->len );
+      es->len = 0;
+} } }
+
+
+/**
+ *  Extractor::endFile writes the remaining data, sets the modification
+ *  time and closes the file. A file with CRC error is removed.
+ */
+
+void Extractor::endFile( const File *file, bool crcOk ) {
+  ExtractorState *es = (ExtractorState *) _state;
+  if ( es->fd < 0 ) return;
+  int fd = es->fd;
+  es->fd = -1;
+  try {
+    if ( es->len > 0 ) writeAll( fd, es->chunk, es->len );
+    es->len = 0;
+    setModified( fd, (const Header *) file->header() );
+  }
+  catch ( ... ) { close( fd ); throw; }
+  close( fd );
+  if ( !crcOk ) {
+    unlink( es->path.c_str() );
+    throw Exception( "zip archive corrupt (CRC32 error)" );
+} }
+
+
+/**
+ *  Extractor::resumeFile continues writing a file at offset after a Stream
+ *  has been restored from a checkpoint. If the file is still open (the 
+ *  same Extractor is used), the buffered data is written first, otherwise 
+ *  the file is reopened. Data written beyond offset is truncated.
+ */
+
+void Extractor::resumeFile( const File *file, long offset ) {
+  ExtractorState *es = (ExtractorState *) _state;
+  std::string p = path( file );
+  if ( (es->fd >= 0) && (p == es->path) ) {
+    if ( es->len > 0 ) writeAll( es->fd, es->chunk, es->len );
+  }
+  else {
+    if ( es->fd >= 0 ) close( es->fd );
+    es->fd = -1;
+    es->path = p;
+    if ( p.back() == '/' ) return;
+    if ( (es->fd = open( p.c_str(), O_WRONLY )) < 0 ) 
+      throw Exception( "can't resume file" );
+  }
+  es->len = 0;
+  struct stat st;
+  if ( fstat( es->fd, &st ) || (st.st_size < offset) || 
+       ftruncate( es->fd, offset ) || (lseek( es->fd, offset, SEEK_SET ) < 0) )
+    throw Exception( "can't resume file" );
+  if ( !es->chunk && posix_memalign( (void **) &es->chunk, 4096, ChunkSize ) )
+    { es->chunk = 0; throw Exception(); }
+}
+
+
+/**
+ *  put2 and put4 store 16 resp. 32 bit numbers in little endian byte order.
+ */
+
+static tByte *put2( tByte *p, unsigned val ) 
+  { p[0] = val & 0xff; p[1] = (val >> 8) & 0xff; return p + 2; }
+static tByte *put4( tByte *p, unsigned val )
+  { return put2( put2( p, val & 0xffff ), val >> 16 ); }
+
+
+/**
+ *  A WriterEntry describes a file written by a Writer, it is used to write
+ *  the central directory.
+ */
+
+struct WriterEntry {
+  std::string	name;		// file name
+  unsigned	method;		// compression method
+  unsigned	flags;		// general purpose flags
+  unsigned	dostime;	// DOS modification time
+  unsigned	dosdate;	// DOS modification date
+  unsigned long	crc;		// CRC-32 of uncompressed data
+  unsigned long	csize;		// compressed size
+  unsigned long	size;		// uncompressed size
+  unsigned long	offset;		// offset of local header
+};
+
+
+/**
+ *  A DeflateBlock is a part of a file's data which is compressed 
+ *  independently of the other blocks. The 32k of data preceeding the block
+ *  are used as dictionary, a block is terminated by a sync flush (or the
+ *  end of the deflate stream for the last block), so the compressed 
+ *  blocks may simply be concatenated.
+ */
+
+struct DeflateBlock {
+  const tByte		*in;		// data to compress
+  long			 len;		// #bytes to compress
+  int			 last;		// last block of data
+  std::vector<tByte>	 out;		// compressed data
+  unsigned long		 crc;		// CRC-32 of data
+  bool			 done;		// block has been compressed
+};
+
+static void deflateBlock( DeflateBlock &b, const tByte *data, int level ) {
+  z_stream zs;
+  memset( &zs, 0, sizeof zs );
+  if ( deflateInit2( &zs, level, Z_DEFLATED, -MAX_WBITS, 8, 
+                     Z_DEFAULT_STRATEGY ) != Z_OK )
+    throw Exception( "libz: deflateInit2 failed" );
+  int ret;
+  try {
+    if ( b.in > data ) {
+      long dlen = ((b.in - data) < 32*1024)? (long)(b.in - data) : 32*1024;
+      if ( deflateSetDictionary( &zs, b.in - dlen, (uInt) dlen ) != Z_OK )
+        throw Exception( "libz: deflateSetDictionary failed" );
+    }
+    b.out.resize( deflateBound( &zs, b.len ) + 16 );
+    zs.next_in = (tByte *) b.in;
+    zs.avail_in = (uInt) b.len;
+    do {
+      if ( zs.total_out == b.out.size() ) b.out.resize( b.out.size() * 2 );
+      zs.next_out = b.out.data() + zs.total_out;
+      zs.avail_out = (uInt)(b.out.size() - zs.total_out);
+      ret = deflate( &zs, b.last? Z_FINISH : Z_SYNC_FLUSH );
+    } while ( (ret == Z_OK) && ((zs.avail_out == 0) || b.last) );
+    b.out.resize( zs.total_out );
+  }
+  catch ( ... ) { deflateEnd( &zs ); throw; }
+  deflateEnd( &zs );
+  if ( ret != (b.last? Z_STREAM_END : Z_OK) ) 
+    throw Exception( "libz: deflate failed" );
+  b.crc = crc32Update( 0, b.in, b.len );
+}
+
+
+/**
+ *  The WriterState holds the central directory and the thread settings of 
+ *  a Writer.
+ */
+
+struct WriterState {
+  std::vector<WriterEntry>	entries;	// files written
+  unsigned long			offset;		// #bytes written
+  int				nthreads;	// #compressing threads
+  int				level;		// compression level
+  bool				finished;	// central directory written
+};
+
+
+/**
+ *  The Writer constructor defines the Sink to write to, the number of 
+ *  threads to use for compressing (0: #cores) and the compression level
+ *  (0-9, -1: libz default).
+ */
+
+Writer::Writer( Sink &sink, int nthreads, int level ) {
+  WriterState *ws = new WriterState;
+  _sink = &sink;
+  if ( nthreads <= 0 ) nthreads = (int) std::thread::hardware_concurrency();
+  ws->nthreads = (nthreads > 0)? nthreads : 1;
+  ws->level = level;
+  ws->offset = 0;
+  ws->finished = false;
+  _state = ws;
+}
+
+Writer::~Writer() {
+  if ( _state ) delete (WriterState *) _state;
+  _state = 0;
+}
+
+
+/**
+ *  Writer::write writes len bytes to the Sink.
+ */
+
+void Writer::write( const void *data, long len ) {
+  _sink -> write( data, len );
+  ((WriterState *) _state) -> offset += len;
+}
+
+
+/**
+ *  Writer::deflate compresses len bytes of data and writes the compressed
+ *  data to the Sink. The data is split into blocks of BlockSize bytes 
+ *  which are compressed by a pool of threads, the compressed blocks are
+ *  written in order as soon as they are available. The CRC-32 of data
+ *  is returned.
+ */
+
+unsigned long Writer::deflate( const void *data, long len ) {
+  WriterState *ws = (WriterState *) _state;
+  const tByte *in = (const tByte *) data;
+  long nblocks = (len + BlockSize - 1) / BlockSize;
+  if ( nblocks == 0 ) nblocks = 1;
+  std::vector<DeflateBlock> blocks( nblocks );
+  for ( long i = 0; i < nblocks; i++ ) {
+    blocks[i].in = in + i * BlockSize;
+    blocks[i].len = (i+1 < nblocks)? (long) BlockSize : len - i * BlockSize;
+    blocks[i].last = (i+1 == nblocks);
+    blocks[i].done = false;
+  }
+  int nthreads = (nblocks < ws->nthreads)? (int) nblocks : ws->nthreads;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::atomic<long> next( 0 );
+  std::exception_ptr error;
+  auto worker = [&]() {
+    long i;
+    while ( (i = next++) < nblocks ) {
+      try { deflateBlock( blocks[i], in, ws->level ); }
+      catch ( ... ) {
+        std::lock_guard<std::mutex> lock( mutex );
+        if ( !error ) error = std::current_exception();
+        next = nblocks;
+      }
+      { std::lock_guard<std::mutex> lock( mutex ); blocks[i].done = true; }
+      cv.notify_all();
+  } };
+  std::vector<std::thread> threads;
+  unsigned long crc = 0;
+  try {
+    if ( nthreads > 1 ) 
+      for ( int t = 0; t < nthreads; t++ ) threads.emplace_back( worker );
+    else worker();
+    for ( long i = 0; i < nblocks; i++ ) {
+      DeflateBlock &b = blocks[i];
+      {
+        std::unique_lock<std::mutex> lock( mutex );
+        cv.wait( lock, [&]() { return b.done || error; } );
+        if ( error ) break;
+      }
+      write( b.out.data(), (long) b.out.size() );
+      crc = (i == 0)? b.crc : crc32_combine( crc, b.crc, b.len );
+      std::vector<tByte>().swap( b.out );
+  } }
+  catch ( ... ) {
+    // a failing Sink or thread creation stops the workers, which have to 
+    // be joined before the blocks go away
+    next = nblocks;
+    for ( auto &t: threads ) t.join();
+    throw;
+  }
+  for ( auto &t: threads ) t.join();
+  if ( error ) std::rethrow_exception( error );
+  return crc;
+}
+
+
+/**
+ *  Writer::addFile writes the file 'name' with the given contents to the 
+ *  archive. A stored file is written as local header (with sizes and CRC)
+ *  followed by the data. A compressed file is written as local header 
+ *  (without sizes), the compressed data and a data descriptor, since its
+ *  compressed size is only known after writing the data. If mtime is 0, 
+ *  the current time is used as modification time.
+ */
+
+void Writer::addFile( const char *name, const void *data, long len, 
+                      bool compress, time_t mtime ) {
+  WriterState *ws = (WriterState *) _state;
+  WriterEntry e;
+  struct tm tm;
+  tByte h[sizeof(Header)], *p;
+  if ( ws->finished ) throw Exception( "zip archive already finished" );
+  // 0xffffffff marks zip64 values in headers
+  if ( (len >= 0xffffffffL) || (ws->offset >= 0xffffffffUL) ) 
+    throw Exception( "zip64 archives are not supported" );
+  if ( strlen( name ) > 0xffff ) 
+    throw Exception( "file name too long for zip archive" );
+  if ( !mtime ) mtime = time( 0 );
+  localtime_r( &mtime, &tm );
+  e.name = name;
+  e.method = compress? Header::Deflated : Header::Stored;
+  e.flags = Header::Utf8Encoded | (compress? Header::DescriptorUsed : 0);
+  e.dostime = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+  e.dosdate = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+  e.size = len;
+  e.csize = compress? 0 : len;
+  e.crc = compress? 0 : crc32Update( 0, (const tByte *) data, len );
+  e.offset = ws->offset;
+  p = put4( h, 0x04034b50 );
+  p = put2( p, 20 );
+  p = put2( p, e.flags );
+  p = put2( p, e.method );
+  p = put2( p, e.dostime );
+  p = put2( p, e.dosdate );
+  p = put4( p, (unsigned) e.crc );
+  p = put4( p, (unsigned) e.csize );
+  p = put4( p, compress? 0 : (unsigned) e.size );
+  p = put2( p, (unsigned) e.name.size() );
+  p = put2( p, 0 );
+  write( h, sizeof h );
+  write( e.name.data(), (long) e.name.size() );
+  if ( !compress ) {
+    write( data, len );
+    ws->entries.push_back( e );
+    return;
+  }
+  unsigned long start = ws->offset;
+  e.crc = deflate( data, len );
+  e.csize = ws->offset - start;
+  if ( e.csize >= 0xffffffffUL )
+    throw Exception( "zip64 archives are not supported" );
+  tByte dd[sizeof(DataDescriptor)];
+  p = put4( dd, 0x08074b50 );
+  p = put4( p, (unsigned) e.crc );
+  p = put4( p, (unsigned) e.csize );
+  p = put4( p, (unsigned) e.size );
+  write( dd, sizeof dd );
+  ws->entries.push_back( e );
+}
+
+
+/**
+ *  Writer::finish writes the central directory and the end of central 
+ *  directory record, no files may be added afterwards.
+ */
+
+void Writer::finish( void ) {
+  WriterState *ws = (WriterState *) _state;
+  if ( ws->finished ) return;
+  unsigned long start = ws->offset, dirsize = 0;
+  for ( auto &e: ws->entries ) dirsize += sizeof(DirHeader) + e.name.size();
+  // offset and size of the central directory must fit as well
+  if ( (ws->entries.size() >= 0xffff) || (start >= 0xffffffffUL) ||
+       (dirsize >= 0xffffffffUL) )
+    throw Exception( "zip64 archives are not supported" );
+  for ( auto &e: ws->entries ) {
+    tByte h[sizeof(DirHeader)], *p;
+    p = put4( h, 0x02014b50 );
+    p = put2( p, (3 << 8) | 20 );	// made by Unix, version 2.0
+    p = put2( p, 20 );
+    p = put2( p, e.flags );
+    p = put2( p, e.method );
+    p = put2( p, e.dostime );
+    p = put2( p, e.dosdate );
+    p = put4( p, (unsigned) e.crc );
+    p = put4( p, (unsigned) e.csize );
+    p = put4( p, (unsigned) e.size );
+    p = put2( p, (unsigned) e.name.size() );
+    p = put2( p, 0 );
+    p = put2( p, 0 );
+    p = put2( p, 0 );
+    p = put2( p, 0 );
+    p = put4( p, 0100644 << 16 );	// regular file, rw-r--r--
+    p = put4( p, (unsigned) e.offset );
+    write( h, sizeof h );
+    write( e.name.data(), (long) e.name.size() );
+  }
+  tByte eod[sizeof(EndOfDir)], *p;
+  p = put4( eod, 0x06054b50 );
+  p = put2( p, 0 );
+  p = put2( p, 0 );
+  p = put2( p, (unsigned) ws->entries.size() );
+  p = put2( p, (unsigned) ws->entries.size() );
+  p = put4( p, (unsigned) dirsize );
+  p = put4( p, (unsigned) start );
+  p = put2( p, 0 );
+  write( eod, sizeof eod );
+  ws->finished = true;
+}
+
+
+/**
+ *  Writer::bytesWritten returns the #bytes written to the Sink so far.
+ */
+
+long Writer::bytesWritten( void ) const {
+  return (long) ((WriterState *) _state) -> offset;
+}
 
 
 } // namespace zip
@@ -19,7 +19,7 @@
  *
  *    class MyDelegate : public zip::StreamDelegate {
  *      public:
- *      void handleFile( zip::File *file );
+ *      void handleFile( zip::FilePtr file );
  *    };
  *
  *    MyDelegate delegate;
@@ -31,8 +31,23 @@
  *      zipstream.scan( buff, bufflen );
  *    }
  *
- *  The zip::File *file parameter passed to MyDelegate::handleFile is allocated
- *  and must be deleted after use.
+ *  The zip::FilePtr (a std::unique_ptr<zip::File>) passed to 
+ *  MyDelegate::handleFile owns the File, it may be moved elsewhere (e.g. 
+ *  to a different thread). Deleting a File returns its buffer to a 
+ *  pool of the Stream, so the buffers are reused for the following files.
+ *  File::release hands the data of a File over to its user instead (e.g. 
+ *  to wrap it in an NSData without copying).
+ *  In arena mode (zip::Stream::setArena) the buffers are taken from large
+ *  slabs instead, which are freed together.
+ *  In streaming mode (zip::Stream::setStreaming) the contents of a file is
+ *  decompressed as soon as it arrives and passed in chunks of uncompressed
+ *  data to StreamDelegate::handleData, enclosed by calls to 
+ *  StreamDelegate::beginFile and StreamDelegate::endFile. This way the 
+ *  memory needed per file is bounded and decompression overlaps receiving.
+ *  Files lying completely in the data passed to zip::Stream::scan are 
+ *  decompressed directly from the caller's memory, so passing large chunks 
+ *  (or a complete mmap'd archive) avoids copying the compressed data.
+ *  zip::FileSource passes a local archive this way.
  *  Typically a 3-thread model may be used to receive, decompress and handle
  *  zipped files:
  *   
@@ -41,6 +56,15 @@
  *      is passed to zip::StreamDelegate::handleFile also in thread 2
  *    - handleFile passes the file for further processing to thread 3.
  *
+ *  zip::PipelinedStream (see below) implements this model.
+ *  zip::Reader turns a streaming Stream around: the caller pulls the 
+ *  files found (and their data) instead of being called back.
+ *
+ *  An interrupted download may be continued without starting over:
+ *  zip::Stream::checkpoint saves the state of a Stream and returns the 
+ *  offset in the archive to continue at (e.g. via an HTTP range request),
+ *  a new Stream restores the state with zip::Stream::restore.
+ *
  *  A zip file is structured as follows:
  *
  *    file header 1
@@ -75,7 +99,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 #include <iostream>
+#include <string>
+#include <memory>
 #include <exception>
 
 namespace zip {
@@ -91,35 +118,163 @@ class Exception : public std::exception {
 };
 
 
+/**
+ *  A Decoder decompresses files using a compression method other than 
+ *  Stored and Deflated. Decoder factories are registered per compression 
+ *  method with Decoder::add, a Stream (or an Archive's extracting thread)
+ *  creates one Decoder per method and reuses it (after reset) for all 
+ *  files. Decoders for zstd (93), bzip2 (12) and LZMA (14) are built in
+ *  if ZIP_HAVE_ZSTD, ZIP_HAVE_BZIP2 resp. ZIP_HAVE_LZMA are defined.
+ */
+
+class Decoder {
+  public:
+  typedef Decoder *(*Factory)( void );
+  virtual ~Decoder() {}
+  // prepares the Decoder for the next file
+  virtual void reset( void ) = 0;
+  // decodes input [in, in+inlen) to [out, out+outlen) and advances the
+  // pointers and lengths, returns true at the end of the compressed data
+  virtual bool decode( const unsigned char *&in, long &inlen, 
+                       unsigned char *&out, long &outlen ) = 0;
+  static void add( unsigned method, Factory factory );
+  static Decoder *create( unsigned method );
+}; // class Decoder
+
+
+/**
+ *  The data of a File taken over by File::release. The data stays valid 
+ *  until dispose() is called (exactly once), which frees it depending on
+ *  where it has been allocated.
+ */
+
+struct Payload {
+  void		*data;		// file data (0: empty file)
+  long		 size;		// #bytes of data
+  void		(*dealloc)( void *context );	// frees data
+  void		*context;	// argument of dealloc
+  void dispose( void ) const { if ( dealloc ) dealloc( context ); }
+};
+
+
 /**
  *  A file stored in a zip archive
  */
 
 class File {
   friend class Stream;
+  friend class Collector;
+  friend class Spill;
   private:
   void		*_header;	// complete Header
   void		*_data;		// uncompressed data
   char		*_name;		// file name
+  void		*_pool;		// opaque buffer pool _header belongs to
+  void		*_arena;	// opaque arena _header and _name belong to
+  int		 _raw;		// _data is the compressed data
+  char		*_path;		// temporary file _data is mapped from
+  File( void ) 
+    { _header = _data = _pool = _arena = 0; _name = _path = 0; _raw = 0; }
+  void alloc( const void *header, int withData, void *pool );
+  void clear( void );
+  void init( const void *header, const void *contents, void *inflater, 
+             void *pool );
+  void init( void *buffer, void *inflater, void *pool );
   public:
   File( void *buffer );
+  File( void *buffer, void *inflater, void *pool ) 
+    { _raw = 0; init( buffer, inflater, pool ); }
+  File( const void *header, const void *contents, void *inflater = 0,
+        void *pool = 0, bool raw = false );
   ~File();
-  void inflate( void *buffer );
+  void inflate( const void *contents, void *inflater = 0 );
+  void decode( const void *contents, void *inflater = 0 );
   void *data( void ) const { return _data; }
   void *header( void ) const { return _header; }
   int size( void ) const;
   const char *name( void ) const { return _name; }
+  bool isRaw( void ) const { return _raw; }
+  // the temporary file data() is mapped from (0: data in memory), it is 
+  // removed when the File is deleted unless it has been renamed
+  const char *path( void ) const { return _path; }
+  // hands the data over to the caller, afterwards data() returns 0 (the 
+  // Header and name are kept)
+  Payload release( void );
 }; // class File
 
 
+// Files are passed around as FilePtr, deleting the File when dropped
+typedef std::unique_ptr<File> FilePtr;
+
+// inflates the raw deflate data [in, in+inlen) of a file of known size
+// into out (size bytes) with the one-shot decoder used for such files and
+// stores the CRC-32 of the output in crc, false is returned if the data 
+// can't be decoded this way (File::inflate then falls back to libz)
+bool inflateKnownSize( const void *in, long inlen, void *out, long size,
+                       unsigned long *crc );
+
+
 /**
  * The virtual StreamDelegate class for handling scanned zip::File's.
  */
 
 class StreamDelegate {
   public:
+  // results of acceptFile
+  enum { Accept = 0, Skip = 1, DataOnly = 2 };
+  virtual ~StreamDelegate() {}
+  // acceptFile is called as soon as the Header and name of a file have been
+  // read. Skipped files are not passed to the delegate and their data is 
+  // discarded without copying or decompressing (unless deflated with 
+  // unknown size, which has to be inflated to find its end). The data of 
+  // DataOnly files is passed as is (compressed, File::isRaw) and its CRC 
+  // isn't checked. The File (without data) is valid during the call only.
+  virtual int acceptFile( const File *file );
   // handleFile is called by zip::Stream when a file has been found
-  virtual void handleFile( File *file );
+  virtual void handleFile( FilePtr file );
+  // handleFiles is called instead of handleFile with n Files found if the
+  // Stream collects Files in batches (see Stream::setBatching), the 
+  // default implementation moves each File to handleFile
+  virtual void handleFiles( FilePtr *files, int n );
+  // In streaming mode beginFile, handleData and endFile are called instead
+  // of handleFile. The File passed contains only the Header and file name
+  // and is deleted by the Stream after endFile.
+  // beginFile is called when the Header of a file has been read
+  virtual void beginFile( const File *file );
+  // handleData is called with the next chunk of uncompressed data
+  virtual void handleData( const File *file, const void *data, int len );
+  // endFile is called after the last chunk, crcOk is false on CRC errors
+  virtual void endFile( const File *file, bool crcOk );
+  // resumeFile is called instead of beginFile if a Stream restored from a
+  // checkpoint (see Stream::checkpoint) continues a file, offset is the 
+  // #bytes passed to handleData before the checkpoint
+  virtual void resumeFile( const File *file, long offset );
+};
+
+
+/**
+ *  An Extractor is a StreamDelegate writing the files to a directory. In
+ *  streaming mode the data is written as it arrives (collected in chunks of
+ *  ChunkSize bytes), otherwise complete Files are written by handleFile, 
+ *  which may be called concurrently (e.g. by Archive::extract). Files of
+ *  known size are preallocated, every directory is created only once and 
+ *  the modification times are taken from the zip headers.
+ */
+
+class Extractor : public StreamDelegate {
+  private:
+  void		*_state;	// opaque directory cache and current file
+  std::string path( const File *file );
+  void mkdirs( const std::string &dir );
+  public:
+  enum { ChunkSize = 1024*1024 };
+  Extractor( const char *dir );
+  ~Extractor();
+  void handleFile( FilePtr file );
+  void beginFile( const File *file );
+  void handleData( const File *file, const void *data, int len );
+  void endFile( const File *file, bool crcOk );
+  void resumeFile( const File *file, long offset );
 };
 
 
@@ -127,16 +282,315 @@ class StreamDelegate {
  *  The Stream class
  */
 
+/**
+ *  Statistics of a zip::Stream (see Stream::stats). The time spent in 
+ *  Stream::scan which is neither spent decompressing nor in the delegate 
+ *  is used to search for and copy file data. CRC-32 checks are part of 
+ *  decompression (stored data is copied and checked in one pass).
+ */
+
+struct StreamStats {
+  long files;			// #files passed to the delegate
+  long skippedFiles;		// #files skipped (StreamDelegate::acceptFile)
+  long bytesSkipped;		// #bytes not belonging to a file
+  long bytesCopied;		// #bytes copied to the Stream's buffer
+  long bytesDirect;		// #bytes of files processed without copying
+  long bytesInflated;		// #bytes of decompressed file data
+  long reallocs;		// #reallocations of the Stream's buffer
+  long bytesMoved;		// #bytes moved by these reallocations
+  long long scan;		// time spent in Stream::scan (nanoseconds)
+  long long decode;		// decompressing and checking file data
+  long long delegate;		// calling the StreamDelegate
+};
+
+
 class Stream {
   private:
   void			*_buffer;	// opaque buffer for stream data
+  void			*_entry;	// opaque file being streamed
+  void			*_inflater;	// opaque libz state used for all files
+  void			*_pool;		// opaque pool of File buffers
+  void			*_collector;	// opaque collector of streamed files
+  bool			 _streaming;	// streaming mode
+  int			 _filter;	// acceptFile result for current file
+  long			 _limit;	// memory limit per file (0: none)
   long       _bytes_read; // bytes read so far
-  StreamDelegate	*_delegate;	// delegate to inform
+  StreamStats		 _stats;	// counters and timings (in ticks)
+  long long		 _created[2];	// ticks and nanoseconds at creation
+  bool			 _timing;	// record timings in _stats
+  StreamDelegate	*_delegate;	// delegate to inform (via a Monitor)
+  int accept( const void *header );
+  bool exceedsLimit( const void *header ) const;
   public:
   Stream( StreamDelegate &delegate );
   ~Stream();
   void scan( const char *buff, int bufflen );
+  // in streaming mode file data is passed in chunks to the delegate
+  void setStreaming( bool streaming = true ) { _streaming = streaming; }
+  bool isStreaming( void ) const { return _streaming; }
+  // larger files are kept in temporary files (0: no limit)
+  void setMemoryLimit( long limit, const char *tmpdir = 0 );
+  // allocates Files in arena generations (see releaseArena)
+  void setArena( bool arena = true );
+  // starts a new generation, the previous one is freed as a whole when 
+  // all of its Files have been deleted
+  void releaseArena( void );
+  // passes Files in batches of 'files' Files resp. 'bytes' bytes (0: any)
+  // to StreamDelegate::handleFiles (0, 0: no batches)
+  void setBatching( int files, long bytes = 0 );
   long bytesRead ( void ) const { return _bytes_read; }
+  // saves the state to resume scanning at the returned offset of the 
+  // archive (-1: not possible in the current file)
+  long checkpoint( std::string &state ) const;
+  // restores a state saved by checkpoint (before scanning any data)
+  void restore( const std::string &state );
+  // counters and timings of the data scanned so far
+  StreamStats stats( void ) const;
+  void setTiming( bool timing = true );
+  long reallocs( void ) const;
+  long bytesMoved( void ) const;
+};
+
+
+/**
+ *  Time spent in the stages of a PipelinedStream (in nanoseconds), 
+ *  "Stalled" is the time a stage waited for the next stage to take its 
+ *  output (backpressure), "Idle" the time a stage waited for input.
+ */
+
+struct PipelineTimes {
+  long long receive;		// copying received data
+  long long receiveStalled;	// waiting for a free chunk slot
+  long long scan;		// scanning and decompressing (Stream::scan)
+  long long scanIdle;		// waiting for received data
+  long long scanStalled;	// waiting for a free file slot
+  long long handle;		// StreamDelegate::handleFile
+  long long handleIdle;		// waiting for decompressed files
+};
+
+
+/**
+ *  The PipelinedStream class implements the 3-thread model described 
+ *  above. PipelinedStream::scan is called by the receiving thread, it
+ *  copies the data and passes it to a scanning thread running zip::Stream.
+ *  Files found are passed to a handling thread calling the delegate's
+ *  handleFile. The stages are connected by lock-free queues holding at 
+ *  most depth entries, if a queue is full the previous stage waits.
+ *
+ *    zip::PipelinedStream zipstream( delegate, 16 );
+ *    while ( !eof ) {
+ *      // read data into buff (length bufflen)
+ *      zipstream.scan( buff, bufflen );
+ *    }
+ *    zipstream.finish();
+ *
+ *  finish() waits until all data has been processed and rethrows an 
+ *  Exception thrown by the scanning or handling thread. scan must not be
+ *  called after finish(). With lots of small files, setBatching lets the
+ *  stages hand over batches of Files instead of single ones.
+ */
+
+class PipelinedStream {
+  private:
+  void			*_pipeline;	// opaque pipeline state
+  public:
+  PipelinedStream( StreamDelegate &delegate, int depth = 16 );
+  ~PipelinedStream();
+  // see Stream::setBatching, must be called before scanning any data
+  void setBatching( int files, long bytes = 0 );
+  void scan( const char *buff, int bufflen );
+  void finish( void );
+  long bytesRead( void ) const;
+  PipelineTimes times( void ) const;
+};
+
+
+/**
+ *  A Reader is the pull style counterpart of a Stream in streaming mode:
+ *  instead of calling a StreamDelegate it returns the Events found in the
+ *  data to the caller, who keeps the control flow (e.g. to interleave 
+ *  network reads, decompression and disk writes on one event loop). The
+ *  data given to 'feed' is not copied but scanned lazily a slice at a time
+ *  when the next Event is requested, so it has to stay valid until 'next'
+ *  returns 0. The Begin Event of a file is returned before its data is
+ *  decompressed:
+ *
+ *    zip::Reader reader;
+ *    while ( (n = read( fd, buff, sizeof buff )) > 0 ) {
+ *      reader.feed( buff, n );
+ *      for ( const zip::Reader::Event &e: reader ) {
+ *        switch ( e.type ) {
+ *          case zip::Reader::Begin: // e.file->name() ...
+ *          case zip::Reader::Data:  // e.data, e.len ...
+ *          case zip::Reader::End:   // e.crcOk ...
+ *    } } }
+ *
+ *  An Event, its File (Header and name only) and data are valid until
+ *  the next call of 'next'. The Header of the File of an End Event 
+ *  contains the sizes and CRC of a data descriptor following the data.
+ */
+
+class Reader {
+  private:
+  void			*_state;	// opaque Stream and queued Events
+  public:
+  enum { Begin = 0, Data = 1, End = 2 };
+  enum { Slice = 16*1024 };
+  struct Event {
+    int			 type;		// Begin, Data or End
+    const File		*file;		// File the Event belongs to
+    const void		*data;		// uncompressed data (Data)
+    int			 len;		// #bytes of data (Data)
+    bool		 crcOk;		// CRC is correct (End)
+  };
+  // iterates the Events up to the end of the data fed
+  class iterator {
+    private:
+    Reader		*_reader;
+    const Event		*_event;	// current Event (0: end)
+    public:
+    iterator( Reader *reader, const Event *event ) 
+      { _reader = reader; _event = event; }
+    const Event &operator*( void ) const { return *_event; }
+    const Event *operator->( void ) const { return _event; }
+    iterator &operator++( void ) { _event = _reader->next(); return *this; }
+    bool operator!=( const iterator &i ) const { return _event != i._event; }
+  };
+  Reader( int slice = Slice );
+  ~Reader();
+  void feed( const void *data, int len );
+  const Event *next( void );
+  bool needsInput( void ) const;
+  long bytesRead( void ) const;
+  iterator begin( void ) { return iterator( this, next() ); }
+  iterator end( void ) { return iterator( this, 0 ); }
+};
+
+
+/**
+ *  The Archive class provides random access to the files of a local zip
+ *  archive. The archive is mapped into memory and only its central 
+ *  directory is read on construction, an index from file names to local
+ *  headers allows to extract single files without scanning the archive:
+ *
+ *    zip::Archive archive( "issue.zip" );
+ *    zip::FilePtr file = archive.extract( "page1.pdf" );
+ *    ...
+ *
+ *  All files of an Archive may be extracted in parallel by a pool of threads
+ *  either to a StreamDelegate or directly to a directory.
+ *
+ *  Arbitrary ranges of a file may be read without extracting it. This is
+ *  cheap for stored files, deflated files have to be inflated from their
+ *  start unless an access index has been built. The index records the
+ *  state of the inflater (32K window) about every 'span' bytes of output
+ *  and is written next to the archive, so ranges of a large deflated
+ *  file (e.g. embedded video) are read in bounded time:
+ *
+ *    zip::Archive archive( "issue.zip" );
+ *    if ( !archive.loadIndex() ) archive.buildIndex();
+ *    long n = archive.read( archive.find( "video.mp4" ), offset, buff, len );
+ */
+
+class Archive {
+  private:
+  int			 _fd;		// file descriptor of archive
+  void			*_map;		// mapped archive
+  long			 _size;		// size of archive
+  void			*_dir;		// opaque central directory index
+  public:
+  Archive( const char *path );
+  ~Archive();
+  int count( void ) const;
+  int find( const char *name ) const;
+  char *name( int i ) const;
+  FilePtr extract( int i ) const;
+  FilePtr extract( const char *name ) const;
+  void extract( StreamDelegate &delegate, int nthreads = 0 ) const;
+  void extractTo( const char *dir, int nthreads = 0 ) const;
+  enum { IndexSpan = 1024*1024, IndexMinSize = 16*1024*1024 };
+  void buildIndex( const char *path = 0, long span = IndexSpan,
+                   long minSize = IndexMinSize );
+  bool loadIndex( const char *path = 0 );
+  long read( int i, long offset, void *buff, long len ) const;
+};
+
+
+/**
+ *  A FileSource passes a local zip archive to a Stream without copying
+ *  it into intermediate buffers:
+ *
+ *    zip::FileSource source( "issue.zip" );
+ *    source.scan( zipstream );
+ *
+ *  The archive is mapped into memory (with sequential read-ahead) and
+ *  given to Stream::scan in windows of 'window' bytes. If it can't be
+ *  mapped, it is read by pread into a single buffer of that size.
+ *  scan may start at an offset, e.g. the one returned by
+ *  Stream::checkpoint.
+ */
+
+class FileSource {
+  private:
+  int			 _fd;		// file descriptor of archive
+  void			*_map;		// mapped archive (or 0)
+  char			*_buff;		// pread buffer if not mapped
+  long			 _size;		// size of archive
+  int			 _window;	// #bytes passed per scan
+  template <class S> void feed( S &stream, long offset );
+  public:
+  enum { Window = 8*1024*1024 };
+  FileSource( const char *path, int window = Window );
+  ~FileSource();
+  long size( void ) const { return _size; }
+  void scan( Stream &stream, long offset = 0 );
+  void scan( PipelinedStream &stream, long offset = 0 );
+};
+
+
+/**
+ *  A Sink receives the data of a zip archive written by a zip::Writer.
+ */
+
+class Sink {
+  public:
+  virtual ~Sink() {}
+  // write is called with the next len bytes of the archive
+  virtual void write( const void *data, long len ) = 0;
+};
+
+
+/**
+ *  The Writer class writes a zip archive to a Sink:
+ *
+ *    zip::Writer writer( sink );
+ *    writer.addFile( "a.txt", data, len );
+ *    ...
+ *    writer.finish();
+ *
+ *  Every compressed file is written as local header, compressed data and
+ *  data descriptor, stored files carry their sizes in the local header.
+ *  finish() writes the central directory. Large files are 
+ *  compressed in parallel by nthreads threads (0: #cores): the data is 
+ *  split into blocks of BlockSize bytes, which are deflated independently 
+ *  (with the 32k preceeding a block as dictionary) and joined by sync 
+ *  flushes.
+ */
+
+class Writer {
+  private:
+  void			*_state;	// opaque central directory and settings
+  Sink			*_sink;		// Sink to write to
+  void write( const void *data, long len );
+  unsigned long deflate( const void *data, long len );
+  public:
+  enum { BlockSize = 128*1024 };
+  Writer( Sink &sink, int nthreads = 0, int level = -1 );
+  ~Writer();
+  void addFile( const char *name, const void *data, long len, 
+                bool compress = true, time_t mtime = 0 );
+  void finish( void );
+  long bytesWritten( void ) const;
 };
 
 
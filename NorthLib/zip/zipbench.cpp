@@ -0,0 +1,338 @@
+/** zipbench.cpp
+ *
+ *  Throughput benchmark of zip::Stream. Reproducible archives of several
+ *  shapes (many tiny files, few huge files, stored or deflated, with or
+ *  without data descriptors) are generated in memory and scanned with
+ *  chunk sizes from 1 KB to 16 MB. For every archive and chunk size one
+ *  line is reported:
+ *
+ *    corpus chunk MB/s files/s allocs reallocs moved(MB) peakRSS(MB)
+ *
+ *  MB/s refers to the size of the archive, allocs counts the calls of
+ *  malloc (glibc only) and operator new per scan of the whole archive,
+ *  reallocs and moved are reported by Stream::reallocs/bytesMoved.
+ *  Every measurement runs in a forked process, so peakRSS is the maximum
+ *  resident set of a single measurement (including the archive itself).
+ *
+ *  Build (not part of the library):
+ *
+ *    c++ -std=c++14 -O2 -o zipbench zipbench.cpp zip.cpp -lz -lpthread
+ *
+ *  Usage:
+ *
+ *    zipbench [-s] [-a] [-t seconds] [-c corpus] [-k chunk] [-w dir]
+ *      -s          use streaming mode (Stream::setStreaming)
+ *      -a          use arena mode (Stream::setArena)
+ *      -t seconds  minimum time per measurement (default 1)
+ *      -c corpus   only run corpora whose name contains 'corpus'
+ *      -k chunk    only use the given chunk size in bytes
+ *      -w dir      write the generated archives to 'dir' and exit
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "zip.hh"
+
+// #allocations since program start
+static std::atomic<long> nallocs( 0 );
+
+void *operator new( size_t size ) {
+  nallocs++;
+  void *p = malloc( size? size : 1 );
+  if ( !p ) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete( void *p ) noexcept { free( p ); }
+void operator delete( void *p, size_t ) noexcept { free( p ); }
+
+#ifdef __GLIBC__
+
+// count malloc calls, too
+extern "C" {
+  extern void *__libc_malloc( size_t size );
+  extern void *__libc_calloc( size_t n, size_t size );
+  extern void *__libc_realloc( void *p, size_t size );
+  void *malloc( size_t size )
+    { nallocs++; return __libc_malloc( size ); }
+  void *calloc( size_t n, size_t size )
+    { nallocs++; return __libc_calloc( n, size ); }
+  void *realloc( void *p, size_t size )
+    { nallocs++; return __libc_realloc( p, size ); }
+}
+
+#endif
+
+
+/**
+ *  A MemorySink collects the archive written by a zip::Writer.
+ */
+
+class MemorySink : public zip::Sink {
+  public:
+  std::vector<unsigned char> data;
+  void write( const void *p, long len ) {
+    data.insert( data.end(), (const unsigned char *) p,
+                 (const unsigned char *) p + len );
+  }
+};
+
+
+/**
+ *  A Counter counts files and uncompressed bytes passed to it by a Stream.
+ */
+
+class Counter : public zip::StreamDelegate {
+  public:
+  long files, bytes;
+  Counter( void ) { files = bytes = 0; }
+  void handleFile( zip::FilePtr file )
+    { files++; bytes += file->size(); }
+  void beginFile( const zip::File * ) { files++; }
+  void handleData( const zip::File *, const void *, int len )
+    { bytes += len; }
+  void endFile( const zip::File *, bool crcOk )
+    { if ( !crcOk ) throw zip::Exception( "CRC32 error" ); }
+};
+
+
+/**
+ *  Random is a xorshift generator, so that the corpora don't depend on
+ *  the C library.
+ */
+
+class Random {
+  unsigned long long _state;
+  public:
+  Random( unsigned long long seed ) { _state = seed; }
+  unsigned next( void ) {
+    _state ^= _state << 13; _state ^= _state >> 7; _state ^= _state << 17;
+    return (unsigned) (_state >> 16);
+  }
+  unsigned next( unsigned min, unsigned max )
+    { return min + next() % (max - min + 1); }
+};
+
+
+/**
+ *  text appends len bytes of text-like data (compressing about 3:1) to
+ *  buff.
+ */
+
+static void text( std::string &buff, long len, Random &rnd ) {
+  static const char *words[] = {
+    "the", "zip", "archive", "stream", "of", "data", "is", "and", "file",
+    "header", "descriptor", "inflate", "buffer", "to", "a", "with", "news",
+    "paper", "issue", "page", "image", "section", "article", "in", "for"
+  };
+  const int nwords = sizeof words / sizeof words[0];
+  long end = (long) buff.size() + len;
+  while ( (long) buff.size() < end ) {
+    buff += words[rnd.next() % nwords];
+    buff += (rnd.next() % 12)? " " : ".\n";
+  }
+  buff.resize( end );
+}
+
+
+/**
+ *  removeDescriptors rewrites an archive written by zip::Writer (which
+ *  always uses data descriptors), so that the sizes and CRCs are stored
+ *  in the local headers and the data descriptors are omitted.
+ */
+
+static unsigned get2( const unsigned char *p ) { return p[0] | (p[1] << 8); }
+static unsigned get4( const unsigned char *p )
+  { return get2( p ) | (get2( p + 2 ) << 16); }
+static void put2( unsigned char *p, unsigned v ) { p[0] = v; p[1] = v >> 8; }
+static void put4( unsigned char *p, unsigned v )
+  { put2( p, v & 0xffff ); put2( p + 2, v >> 16 ); }
+
+static std::vector<unsigned char>
+removeDescriptors( const std::vector<unsigned char> &zip ) {
+  std::vector<unsigned char> ret;
+  const unsigned char *eod = zip.data() + zip.size() - 22;
+  unsigned n = get2( eod + 10 );
+  std::vector<unsigned char> dir( zip.begin() + get4( eod + 16 ),
+                                  zip.end() - 22 );
+  unsigned char *d = dir.data();
+  for ( unsigned i = 0; i < n; i++ ) {
+    unsigned csize = get4( d + 20 ), off = get4( d + 42 );
+    const unsigned char *h = zip.data() + off;
+    unsigned hlen = 30 + get2( h + 26 ) + get2( h + 28 );
+    put2( d + 8, get2( d + 8 ) & ~8 );
+    put4( d + 42, (unsigned) ret.size() );
+    ret.insert( ret.end(), h, h + hlen + csize );
+    unsigned char *lh = ret.data() + ret.size() - hlen - csize;
+    put2( lh + 6, get2( lh + 6 ) & ~8 );
+    memcpy( lh + 14, d + 16, 12 );	// CRC and sizes
+    d += 46 + get2( d + 28 ) + get2( d + 30 ) + get2( d + 32 );
+  }
+  unsigned dstart = (unsigned) ret.size();
+  ret.insert( ret.end(), dir.begin(), dir.end() );
+  ret.insert( ret.end(), eod, eod + 22 );
+  put4( ret.data() + ret.size() - 6, dstart );
+  return ret;
+}
+
+
+/**
+ *  A Corpus is a generated archive.
+ */
+
+struct Corpus {
+  std::string			name;
+  std::vector<unsigned char>	zip;
+  long				files;
+};
+
+static std::string corpusName( const char *shape, bool deflated, 
+                               bool descriptors ) {
+  return std::string( shape ) + (deflated? "-deflated" : "-stored") +
+         (descriptors? "-dd" : "");
+}
+
+static Corpus corpus( const char *shape, bool deflated, bool descriptors ) {
+  Corpus c;
+  MemorySink sink;
+  zip::Writer w( sink );
+  Random rnd( 4711 );
+  std::string data;
+  char name[64];
+  bool tiny = !strcmp( shape, "tiny" );
+  c.files = tiny? 10000 : 4;
+  for ( long i = 0; i < c.files; i++ ) {
+    data.clear();
+    text( data, tiny? rnd.next( 64, 2048 ) : rnd.next( 24, 40 ) << 20, rnd );
+    snprintf( name, sizeof name, "%s/f%05ld.txt", shape, i );
+    w.addFile( name, data.data(), (long) data.size(), deflated, 1500000000 );
+  }
+  w.finish();
+  c.name = corpusName( shape, deflated, descriptors );
+  c.zip = descriptors? sink.data : removeDescriptors( sink.data );
+  return c;
+}
+
+
+/**
+ *  measure scans the archive repeatedly (for at least 'seconds') with the
+ *  given chunk size and prints the results.
+ */
+
+static void measure( const Corpus &c, int chunk, bool streaming, 
+                     bool arena, double seconds ) {
+  using namespace std::chrono;
+  long runs = 0, allocs = 0, reallocs = 0, moved = 0;
+  double elapsed = 0;
+  while ( (elapsed < seconds) || (runs == 0) ) {
+    Counter counter;
+    long nstart = nallocs;
+    auto start = steady_clock::now();
+    {
+      zip::Stream stream( counter );
+      if ( streaming ) stream.setStreaming();
+      if ( arena ) stream.setArena();
+      const char *p = (const char *) c.zip.data();
+      long len = (long) c.zip.size();
+      for ( long off = 0; off < len; off += chunk )
+        stream.scan( p + off, (int) ((len - off < chunk)? len - off : chunk) );
+      reallocs += stream.reallocs();
+      moved += stream.bytesMoved();
+    }
+    elapsed += duration<double>( steady_clock::now() - start ).count();
+    allocs += nallocs - nstart;
+    if ( counter.files != c.files ) {
+      fprintf( stderr, "%s: %ld of %ld files found\n", c.name.c_str(),
+               counter.files, c.files );
+      exit( 1 );
+    }
+    runs++;
+  }
+  struct rusage ru;
+  getrusage( RUSAGE_SELF, &ru );
+#ifdef __APPLE__
+  double rss = ru.ru_maxrss / 1048576.0;	// bytes
+#else
+  double rss = ru.ru_maxrss / 1024.0;		// kilobytes
+#endif
+  printf( "%-22s %9d %9.1f %10.0f %9ld %9ld %9.1f %9.1f\n", c.name.c_str(),
+          chunk, c.zip.size() * runs / elapsed / 1048576,
+          c.files * runs / elapsed, allocs / runs, reallocs / runs,
+          moved / runs / 1048576.0, rss );
+  fflush( stdout );
+}
+
+int main( int argc, char **argv ) {
+  bool streaming = false, arena = false;
+  double seconds = 1;
+  const char *only = 0, *wdir = 0;
+  int onlychunk = 0, opt;
+  while ( (opt = getopt( argc, argv, "sat:c:k:w:" )) != -1 ) {
+    switch ( opt ) {
+      case 's': streaming = true; break;
+      case 'a': arena = true; break;
+      case 't': seconds = atof( optarg ); break;
+      case 'c': only = optarg; break;
+      case 'k': onlychunk = atoi( optarg ); break;
+      case 'w': wdir = optarg; break;
+      default:
+        fprintf( stderr, "usage: %s [-s] [-a] [-t seconds] [-c corpus] "
+                 "[-k chunk] [-w dir]\n", argv[0] );
+        return 1;
+  } }
+  std::vector<int> chunks;
+  if ( onlychunk > 0 ) chunks.push_back( onlychunk );
+  else for ( int k = 10; k <= 24; k += 2 ) chunks.push_back( 1 << k );
+  if ( !wdir )
+    printf( "%-22s %9s %9s %10s %9s %9s %9s %9s\n", "corpus", "chunk", 
+            "MB/s", "files/s", "allocs", "reallocs", "moved", "peakRSS" );
+  fflush( stdout );
+  for ( const char *shape: { "tiny", "huge" } ) {
+    for ( int deflated = 0; deflated < 2; deflated++ ) {
+      for ( int dd = 0; dd < 2; dd++ ) {
+        try {
+          if ( only && !strstr( corpusName( shape, deflated, dd ).c_str(),
+                                only ) ) 
+            continue;
+          Corpus c = corpus( shape, deflated, dd );
+          if ( wdir ) {
+            std::string path = std::string( wdir ) + "/" + c.name + ".zip";
+            FILE *fp = fopen( path.c_str(), "wb" );
+            if ( !fp || (fwrite( c.zip.data(), 1, c.zip.size(), fp ) !=
+                         c.zip.size()) ) {
+              perror( path.c_str() );
+              return 1;
+            }
+            fclose( fp );
+            continue;
+          }
+          for ( int chunk: chunks ) {
+            pid_t pid = fork();
+            if ( pid == 0 ) {
+              try { measure( c, chunk, streaming, arena, seconds ); }
+              catch ( zip::Exception &e ) {
+                fprintf( stderr, "%s: %s\n", c.name.c_str(), e.what() );
+                _exit( 1 );
+              }
+              _exit( 0 );
+            }
+            int status;
+            if ( (pid < 0) || (waitpid( pid, &status, 0 ) < 0) ||
+                 !WIFEXITED( status ) || WEXITSTATUS( status ) )
+              return 1;
+        } }
+        catch ( zip::Exception &e ) {
+          fprintf( stderr, "%s: %s\n", shape, e.what() );
+          return 1;
+  } } } }
+  return 0;
+}
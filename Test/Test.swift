@@ -249,7 +249,7 @@ class ZipTests: XCTestCase {
     let zfile = ZipFile(path: testPath)
     let destTop = "\(testDir!)/unpacked"
     let dest = "\(destTop)/zipfile"
-    zfile.unpack(toDir: dest)
+    XCTAssertTrue(zfile.unpack(toDir: dest))
     for fn in ["a.txt", "b.txt"] {
       let data = File("\(dest)/\(fn)").data
       print( "file \(fn) with \(data.count) bytes content unpacked")
@@ -260,6 +260,82 @@ class ZipTests: XCTestCase {
     Dir(dest).remove()
   }
   
+  func testZipStreamChunks() {
+    guard let zip = FileManager.default.contents(atPath: testPath)
+    else { XCTFail("can't read \(testPath!)"); return }
+    for chunk in [1, 7, 100, zip.count] {
+      self.nerrors = 0
+      var nfiles = 0
+      let zipStream = ZipStream()
+      zipStream.onFile { (name, data) in
+        nfiles += 1
+        self.checkContent(name: name, data: data)
+      }
+      var pos = 0
+      while pos < zip.count {
+        let end = min(pos + chunk, zip.count)
+        zipStream.scanData(zip.subdata(in: pos..<end))
+        pos = end
+      }
+      XCTAssertEqual(nfiles, 2)
+      XCTAssertEqual(self.nerrors, 0)
+      XCTAssertEqual(zipStream.stats["files"]?.intValue, 2)
+      XCTAssertEqual(zipStream.bytesReceived, zip.count)
+    }
+  }
+  
+  func testZipStreamScanFile() {
+    self.nerrors = 0
+    var nfiles = 0
+    let zipStream = ZipStream()
+    zipStream.onFile { (name, data) in
+      nfiles += 1
+      self.checkContent(name: name, data: data)
+    }
+    XCTAssertTrue(zipStream.scanFile(testPath))
+    XCTAssertEqual(nfiles, 2)
+    XCTAssertEqual(self.nerrors, 0)
+    XCTAssertFalse(ZipStream().scanFile("\(testDir!)/nonexistent.zip"))
+  }
+  
+  func testZipStreamRestore() {
+    let dest = "\(NSTemporaryDirectory())/restored"
+    let zipStream = ZipStream()
+    zipStream.extract(toDir: dest)
+    var offset = 0
+    guard let state = zipStream.checkpoint(&offset)
+    else { XCTFail("no checkpoint"); return }
+    XCTAssertEqual(offset, 0)
+    // stale or truncated checkpoints are rejected
+    XCTAssertFalse(ZipStream().restore(Data()))
+    XCTAssertFalse(ZipStream().restore(Data(repeating: 0xff, count: 100)))
+    XCTAssertFalse(ZipStream().restore(state.subdata(in: 0..<state.count/2)))
+    let restored = ZipStream()
+    restored.extract(toDir: dest)
+    XCTAssertTrue(restored.restore(state))
+    XCTAssertTrue(restored.scanFile(testPath))
+    for fn in ["a.txt", "b.txt"] {
+      checkContent(name: fn, data: File("\(dest)/\(fn)").data)
+    }
+    XCTAssertEqual(self.nerrors, 0)
+    Dir(dest).remove()
+  }
+  
+  func testZipFileCorrupt() {
+    guard var zip = FileManager.default.contents(atPath: testPath)
+    else { XCTFail("can't read \(testPath!)"); return }
+    // a.txt claims to be deflated, its data starts with an invalid block
+    zip[8] = 8
+    zip[63] = 0xff
+    let path = "\(NSTemporaryDirectory())/corrupt.zip"
+    XCTAssertTrue(FileManager.default.createFile(atPath: path, contents: zip))
+    let dest = "\(NSTemporaryDirectory())/unpacked"
+    XCTAssertFalse(ZipFile(path: path).unpack(toDir: dest))
+    XCTAssertFalse(ZipFile(path: "\(path).missing").unpack(toDir: dest))
+    File(path).remove()
+    Dir(dest).remove()
+  }
+  
 } // class ZipTests
 
 class DefaultsTests: XCTestCase {
@@ -9,11 +9,324 @@
 #import <XCTest/XCTest.h>
 #include "NorthLib/strext.h"
 #include "NorthLib/fileop.h"
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "zip.hh"
 
 @interface TestLowlevel : XCTestCase
 
 @end
 
+// compresses data with libz into a raw deflate stream
+static std::string deflateRaw( const std::string &data, int level, 
+                               int strategy ) {
+  z_stream zs;
+  memset( &zs, 0, sizeof zs );
+  deflateInit2( &zs, level, Z_DEFLATED, -15, 8, strategy );
+  std::string out( deflateBound( &zs, data.size() ), 0 );
+  zs.next_in = (Bytef *) data.data();
+  zs.avail_in = (uInt) data.size();
+  zs.next_out = (Bytef *) &out[0];
+  zs.avail_out = (uInt) out.size();
+  deflate( &zs, Z_FINISH );
+  out.resize( zs.total_out );
+  deflateEnd( &zs );
+  return out;
+}
+
+// returns size bytes of text (compressible) or random data
+static std::string testData( long size, bool text ) {
+  static const char *words[] = { "zip ", "stream ", "deflate ", "the ", 
+    "archive ", "of ", "a ", "newspaper\n", "page ", "1984 " };
+  std::string data;
+  srand( 42 );
+  while ( (long) data.size() < size ) {
+    if ( text ) data += words[rand() % 10];
+    else data += (char) rand();
+  }
+  data.resize( size );
+  return data;
+}
+
+// inflates a raw deflate stream with the one-shot decoder
+static bool fastInflate( const std::string &in, std::string &out, 
+                         long size, unsigned long *crc ) {
+  out.assign( size + 1, 0 );
+  bool ret = zip::inflateKnownSize( in.data(), (long) in.size(), &out[0], 
+                                    size, crc );
+  out.resize( size );
+  return ret;
+}
+
+// collects the files of an archive by name
+class Collect : public zip::StreamDelegate {
+  public:
+  std::map<std::string, std::string> files;
+  std::string current;
+  int resumed = 0;
+  void handleFile( zip::FilePtr file ) {
+    files[file->name()] = std::string( (const char *) file->data(), 
+                                       file->size() );
+  }
+  void beginFile( const zip::File * ) { current.clear(); }
+  void handleData( const zip::File *, const void *data, int len ) 
+    { current.append( (const char *) data, len ); }
+  void endFile( const zip::File *file, bool crcOk ) 
+    { files[file->name()] = crcOk? current : "CRC error"; }
+  void resumeFile( const zip::File *, long offset ) 
+    { current.resize( offset ); resumed++; }
+};
+
+// collects the files of an archive passed in batches
+class Batches : public Collect {
+  public:
+  std::vector<int> sizes;
+  void handleFiles( zip::FilePtr *files, int n ) {
+    sizes.push_back( n );
+    // every second File is left to the Stream
+    for ( int i = 0; i < n; i += 2 ) handleFile( std::move( files[i] ) );
+  }
+};
+
+// checks the order of the streaming callbacks
+class Trace : public Collect {
+  public:
+  int begins = 0, datas = 0, ends = 0, handled = 0;
+  bool inFile = false, ordered = true;
+  void handleFile( zip::FilePtr file ) 
+    { handled++; Collect::handleFile( std::move( file ) ); }
+  void beginFile( const zip::File *file ) {
+    if ( inFile ) ordered = false;
+    inFile = true; begins++;
+    Collect::beginFile( file );
+  }
+  void handleData( const zip::File *file, const void *data, int len ) {
+    if ( !inFile || (len <= 0) ) ordered = false;
+    datas++;
+    Collect::handleData( file, data, len );
+  }
+  void endFile( const zip::File *file, bool crcOk ) {
+    if ( !inFile ) ordered = false;
+    inFile = false; ends++;
+    Collect::endFile( file, crcOk );
+  }
+};
+
+// collects the files of an archive passed concurrently
+class SafeCollect : public Collect {
+  public:
+  std::mutex mutex;
+  void handleFile( zip::FilePtr file ) {
+    std::lock_guard<std::mutex> lock( mutex );
+    Collect::handleFile( std::move( file ) );
+  }
+};
+
+// skips random.bin and takes text.txt as is (compressed)
+class Filter : public Collect {
+  public:
+  std::map<std::string, bool> raw;
+  int acceptFile( const zip::File *file ) {
+    std::string name = file->name();
+    if ( name == "random.bin" ) return Skip;
+    if ( name == "text.txt" ) return DataOnly;
+    return Accept;
+  }
+  void handleFile( zip::FilePtr file ) {
+    raw[file->name()] = file->isRaw();
+    Collect::handleFile( std::move( file ) );
+  }
+  void beginFile( const zip::File *file ) {
+    raw[file->name()] = file->isRaw();
+    Collect::beginFile( file );
+  }
+};
+
+// records the temporary files Files are mapped from
+class Spilled : public Collect {
+  public:
+  std::map<std::string, std::string> paths;
+  bool exist = true;
+  void handleFile( zip::FilePtr file ) {
+    if ( file->path() ) {
+      paths[file->name()] = file->path();
+      if ( access( file->path(), F_OK ) != 0 ) exist = false;
+    }
+    Collect::handleFile( std::move( file ) );
+  }
+};
+
+// keeps the Files passed
+class Keep : public zip::StreamDelegate {
+  public:
+  std::vector<zip::FilePtr> files;
+  void handleFile( zip::FilePtr file ) { files.push_back( std::move( file ) ); }
+};
+
+// collects the archive written by a Writer
+class StringSink : public zip::Sink {
+  public:
+  std::string data;
+  void write( const void *buff, long len ) 
+    { data.append( (const char *) buff, len ); }
+};
+
+// scans an archive in chunks of chunk bytes starting at offset
+static void scanArchive( zip::Stream &stream, const std::string &zip,
+                         long chunk, long offset = 0 ) {
+  for ( long pos = offset; pos < (long) zip.size(); pos += chunk ) {
+    long len = std::min( chunk, (long) zip.size() - pos );
+    stream.scan( zip.data() + pos, (int) len );
+  }
+}
+
+// passes an archive in chunks of chunk bytes to a PipelinedStream, the
+// chunk buffer is reused (and overwritten) after every scan
+static void pipeArchive( zip::PipelinedStream &stream, const std::string &zip,
+                         long chunk ) {
+  std::string buff;
+  for ( size_t pos = 0; pos < zip.size(); pos += chunk ) {
+    buff = zip.substr( pos, chunk );
+    stream.scan( buff.data(), (int) buff.size() );
+    buff.assign( buff.size(), 0 );
+  }
+  stream.finish();
+}
+
+// reads ranges of all files of an Archive and compares them with files
+static bool readRanges( const zip::Archive &archive, 
+                        std::map<std::string, std::string> &files ) {
+  char buff[5000];
+  for ( auto &f: files ) {
+    int i = archive.find( f.first.c_str() );
+    long size = (long) f.second.size();
+    for ( long offset: { 0L, 1L, 70000L, 1000000L, size - 10, size, 
+                         size + 5 } ) {
+      if ( offset < 0 ) continue;
+      long n = archive.read( i, offset, buff, sizeof buff ),
+           expected = std::max( 0L, std::min( (long) sizeof buff, 
+                                              size - offset ) );
+      if ( (n != expected) || 
+           (n && (f.second.compare( offset, n, buff, n ) != 0)) ) 
+        return false;
+    }
+  }
+  return true;
+}
+
+// reads an archive fed in chunks of chunk bytes with a Reader, returns 
+// false if the Events are out of order
+static bool readArchive( zip::Reader &reader, const std::string &zip, 
+                         long chunk, 
+                         std::map<std::string, std::string> &files ) {
+  std::string current;
+  const zip::File *file = 0;
+  for ( size_t pos = 0; pos < zip.size(); pos += chunk ) {
+    reader.feed( zip.data() + pos, 
+                 (int) std::min( (size_t) chunk, zip.size() - pos ) );
+    if ( reader.needsInput() ) return false;
+    for ( const zip::Reader::Event &e: reader ) {
+      if ( (e.type == zip::Reader::Begin) == (file != 0) ) return false;
+      switch ( e.type ) {
+        case zip::Reader::Begin: current.clear(); file = e.file; break;
+        case zip::Reader::Data: 
+          current.append( (const char *) e.data, e.len ); break;
+        case zip::Reader::End: 
+          files[e.file->name()] = e.crcOk? current : "CRC error"; 
+          file = 0;
+          break;
+      }
+    }
+    if ( !reader.needsInput() ) return false;
+  }
+  return file == 0;
+}
+
+// returns the path of name in the temporary directory
+static std::string tmpPath( const char *name ) {
+  return [NSTemporaryDirectory() 
+    stringByAppendingPathComponent: @(name)].UTF8String;
+}
+
+// writes data to a temporary file and returns its path
+static std::string tmpFile( const char *name, const std::string &data ) {
+  std::string path = tmpPath( name );
+  FILE *fp = fopen( path.c_str(), "wb" );
+  if ( fp ) {
+    fwrite( data.data(), 1, data.size(), fp );
+    fclose( fp );
+  }
+  return path;
+}
+
+// returns the contents of the file at path
+static std::string readFile( const std::string &path ) {
+  std::string data;
+  FILE *fp = fopen( path.c_str(), "rb" );
+  if ( fp ) {
+    char buff[4096];
+    size_t n;
+    while ( (n = fread( buff, 1, sizeof buff, fp )) > 0 ) 
+      data.append( buff, n );
+    fclose( fp );
+  }
+  return data;
+}
+
+// stores a 4 byte little endian number at data[pos]
+static void put4( std::string &data, size_t pos, unsigned long val ) {
+  for ( int i = 0; i < 4; i++ ) data[pos + i] = (char) (val >> (8*i));
+}
+
+// a Decoder for method CopyMethod, whose data is stored as is
+enum { CopyMethod = 0xc0 };
+class CopyDecoder : public zip::Decoder {
+  public:
+  static Decoder *create( void ) { return new CopyDecoder; }
+  void reset( void ) {}
+  bool decode( const unsigned char *&in, long &inlen, unsigned char *&out, 
+               long &outlen ) {
+    long n = std::min( inlen, outlen );
+    memcpy( out, in, n );
+    in += n; inlen -= n;
+    out += n; outlen -= n;
+    return false;
+  }
+};
+
+// sets the compression method of the file 'name' in the local header and
+// central directory
+static void setMethod( std::string &zip, const char *name, unsigned method ) {
+  size_t pos = zip.find( name ) - 30 + 8, cpos = zip.rfind( name ) - 46 + 10;
+  zip[pos] = zip[cpos] = (char) method;
+  zip[pos + 1] = zip[cpos + 1] = (char) (method >> 8);
+}
+
+// writes an archive of stored and deflated files to sink
+static std::map<std::string, std::string> writeArchive( StringSink &sink ) {
+  std::map<std::string, std::string> files;
+  files["empty"] = "";
+  files["small.txt"] = "a small stored file\n";
+  files["text.txt"] = testData( 2*1024*1024, true );
+  files["random.bin"] = testData( 300*1024, false );
+  files["dir/other.bin"] = testData( 100*1024, false );
+  zip::Writer writer( sink, 4 );
+  writer.addFile( "empty", "", 0 );
+  writer.addFile( "small.txt", files["small.txt"].data(), 
+                  (long) files["small.txt"].size(), false );
+  writer.addFile( "text.txt", files["text.txt"].data(), 
+                  (long) files["text.txt"].size() );
+  writer.addFile( "random.bin", files["random.bin"].data(), 
+                  (long) files["random.bin"].size(), false );
+  writer.addFile( "dir/other.bin", files["dir/other.bin"].data(), 
+                  (long) files["dir/other.bin"].size() );
+  writer.finish();
+  return files;
+}
+
 @implementation TestLowlevel
 
 - (void) setUp {
@@ -193,4 +506,621 @@
   str_release(&tmp);
 }
 
+- (void) testFastInflate {
+  std::string text = testData( 1024*1024, true ), 
+              random = testData( 200*1024, false ), out;
+  unsigned long crc;
+  // stored, fixed and dynamic blocks
+  struct { const std::string *data; int level, strategy, type; } cases[] = {
+    { &text, 0, Z_DEFAULT_STRATEGY, 0 },
+    { &text, 6, Z_FIXED, 1 },
+    { &text, 6, Z_DEFAULT_STRATEGY, 2 },
+    { &text, 9, Z_HUFFMAN_ONLY, 2 },
+    { &text, 1, Z_RLE, 2 },
+    { &random, 6, Z_DEFAULT_STRATEGY, 0 }
+  };
+  for ( auto &c: cases ) {
+    std::string in = deflateRaw( *c.data, c.level, c.strategy );
+    XCTAssert(((in[0] >> 1) & 3) == c.type);
+    XCTAssert(fastInflate( in, out, c.data->size(), &crc ));
+    XCTAssert(out == *c.data);
+    XCTAssert(crc == crc32( 0, (const Bytef *) c.data->data(), 
+                            (uInt) c.data->size() ));
+  }
+  std::string small = "a", empty;
+  XCTAssert(fastInflate( deflateRaw( small, 6, Z_DEFAULT_STRATEGY ), out, 
+                         1, &crc ));
+  XCTAssert(out == small);
+  XCTAssert(fastInflate( deflateRaw( empty, 6, Z_DEFAULT_STRATEGY ), out, 
+                         0, &crc ));
+  XCTAssert(crc == 0);
+  // corrupt input is rejected (or fails the CRC check)
+  std::string in = deflateRaw( text, 6, Z_DEFAULT_STRATEGY ), bad = in;
+  bad[0] |= 6;
+  XCTAssert(!fastInflate( bad, out, text.size(), &crc ));
+  bad = in.substr( 0, in.size() / 2 );
+  XCTAssert(!fastInflate( bad, out, text.size(), &crc ));
+  XCTAssert(!fastInflate( in, out, text.size() - 1, &crc ));
+  bad = in;
+  bad[bad.size() / 2] ^= 0x55;
+  XCTAssert(!fastInflate( bad, out, text.size(), &crc ) || 
+            (crc != crc32( 0, (const Bytef *) text.data(), 
+                           (uInt) text.size() )));
+}
+
+- (void) testWriter {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  // Stream with and without streaming mode
+  for ( int streaming = 0; streaming < 2; streaming++ ) {
+    for ( long chunk: { 1000L, 64*1024L, (long) sink.data.size() } ) {
+      Collect collect;
+      zip::Stream stream( collect );
+      stream.setStreaming( streaming );
+      scanArchive( stream, sink.data, chunk );
+      XCTAssert(collect.files == files);
+    }
+  }
+  // Archive
+  std::string path = tmpFile( "writer.zip", sink.data );
+  {
+    zip::Archive archive( path.c_str() );
+    XCTAssert(archive.count() == (int) files.size());
+    for ( int i = 0; i < archive.count(); i++ ) {
+      zip::FilePtr file = archive.extract( i );
+      XCTAssert(std::string( (const char *) file->data(), file->size() ) == 
+                files[file->name()]);
+    }
+  }
+  unlink( path.c_str() );
+  // Reader
+  zip::Reader reader;
+  std::map<std::string, std::string> read;
+  std::string current;
+  for ( size_t pos = 0; pos < sink.data.size(); pos += 4096 ) {
+    reader.feed( sink.data.data() + pos, 
+                 (int) std::min( (size_t) 4096, sink.data.size() - pos ) );
+    for ( const zip::Reader::Event &e: reader ) {
+      switch ( e.type ) {
+        case zip::Reader::Begin: current.clear(); break;
+        case zip::Reader::Data: 
+          current.append( (const char *) e.data, e.len ); break;
+        case zip::Reader::End: 
+          XCTAssert(e.crcOk);
+          read[e.file->name()] = current; 
+          break;
+      }
+    }
+    XCTAssert(reader.needsInput());
+  }
+  XCTAssert(read == files);
+  // names not fitting into 16 bits are rejected
+  StringSink other;
+  zip::Writer writer( other );
+  XCTAssertThrows(writer.addFile( std::string( 0x10000, 'x' ).c_str(), 
+                                  "", 0 ));
+}
+
+- (void) testArchive {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  std::string path = tmpFile( "archive.zip", sink.data );
+  {
+    zip::Archive archive( path.c_str() );
+    XCTAssert(archive.count() == (int) files.size());
+    for ( auto &f: files ) {
+      int i = archive.find( f.first.c_str() );
+      XCTAssert(i >= 0);
+      char *name = archive.name( i );
+      XCTAssert(name && (f.first == name));
+      free( name );
+      zip::FilePtr file = archive.extract( f.first.c_str() );
+      XCTAssert(file && (std::string( (const char *) file->data(), 
+                                      file->size() ) == f.second));
+    }
+    XCTAssert(archive.find( "missing" ) < 0);
+    XCTAssert(!archive.extract( "missing" ));
+  }
+  // a stored file claiming more data than it has is rejected, in the
+  // central directory (Archive) as well as in the local header (Stream)
+  size_t local = sink.data.find( "small.txt" ) - 30,
+         central = sink.data.rfind( "small.txt" ) - 46;
+  std::string bad = sink.data;
+  put4( bad, central + 24, 0x7fffff00 );
+  path = tmpFile( "archive.zip", bad );
+  {
+    zip::Archive archive( path.c_str() );
+    XCTAssertThrows(archive.extract( "small.txt" ));
+    XCTAssert(archive.extract( "text.txt" ));
+  }
+  unlink( path.c_str() );
+  bad = sink.data;
+  put4( bad, local + 22, 0x7fffff00 );
+  Collect collect;
+  zip::Stream stream( collect );
+  XCTAssertThrows(stream.scan( bad.data(), (int) bad.size() ));
+}
+
+- (void) testDecoder {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  std::string zip = sink.data;
+  zip::Decoder::add( CopyMethod, CopyDecoder::create );
+  setMethod( zip, "random.bin", CopyMethod );
+  for ( int streaming = 0; streaming < 2; streaming++ ) {
+    Collect collect;
+    zip::Stream stream( collect );
+    stream.setStreaming( streaming );
+    scanArchive( stream, zip, 1000 );
+    XCTAssert(collect.files == files);
+  }
+  std::string path = tmpFile( "decoder.zip", zip );
+  {
+    zip::Archive archive( path.c_str() );
+    zip::FilePtr file = archive.extract( "random.bin" );
+    XCTAssert(file && (std::string( (const char *) file->data(), 
+                                    file->size() ) == files["random.bin"]));
+  }
+  unlink( path.c_str() );
+  // methods without Decoder are rejected
+  setMethod( zip, "random.bin", CopyMethod + 1 );
+  for ( int streaming = 0; streaming < 2; streaming++ ) {
+    Collect collect;
+    zip::Stream stream( collect );
+    stream.setStreaming( streaming );
+    XCTAssertThrows(scanArchive( stream, zip, 1000 ));
+  }
+}
+
+- (void) testZeroCopy {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  for ( int streaming = 0; streaming < 2; streaming++ ) {
+    // files contained in one scan are decompressed in place, only headers
+    // and data descriptors are copied
+    Collect collect;
+    zip::Stream stream( collect );
+    stream.setStreaming( streaming );
+    scanArchive( stream, sink.data, (long) sink.data.size() );
+    XCTAssert(collect.files == files);
+    zip::StreamStats stats = stream.stats();
+    XCTAssert(stats.bytesDirect > 0);
+    XCTAssert(stats.bytesCopied < 1024);
+    // stored files crossing chunk boundaries are copied (but streamed in
+    // streaming mode)
+    Collect chunked;
+    zip::Stream other( chunked );
+    other.setStreaming( streaming );
+    scanArchive( other, sink.data, 1000 );
+    XCTAssert(chunked.files == files);
+    XCTAssert(streaming || (other.stats().bytesCopied >= 
+                            (long) files["random.bin"].size()));
+  }
+}
+
+- (void) testStreaming {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  for ( long chunk: { 100L, 4096L, (long) sink.data.size() } ) {
+    Trace trace;
+    zip::Stream stream( trace );
+    stream.setStreaming();
+    scanArchive( stream, sink.data, chunk );
+    XCTAssert(trace.files == files);
+    XCTAssert(trace.ordered && !trace.inFile);
+    XCTAssert(trace.begins == (int) files.size());
+    XCTAssert(trace.ends == (int) files.size());
+    XCTAssert(trace.handled == 0);
+    // large files are passed in several pieces
+    XCTAssert(trace.datas > (int) files.size());
+  }
+  // without streaming mode only complete Files are passed
+  Trace trace;
+  zip::Stream stream( trace );
+  scanArchive( stream, sink.data, 4096 );
+  XCTAssert(trace.files == files);
+  XCTAssert(trace.handled == (int) files.size());
+  XCTAssert(trace.begins + trace.datas + trace.ends == 0);
+  // a corrupt file fails the CRC check
+  std::string bad = sink.data;
+  bad[bad.find( "random.bin" ) + 10 + 1000] ^= 0x55;
+  Trace corrupt;
+  zip::Stream other( corrupt );
+  other.setStreaming();
+  scanArchive( other, bad, 4096 );
+  XCTAssert(corrupt.files["random.bin"] == "CRC error");
+  XCTAssert(corrupt.files["text.txt"] == files["text.txt"]);
+}
+
+- (void) testParallelExtract {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  std::string path = tmpFile( "parallel.zip", sink.data ),
+              dir = tmpPath( "parallel" );
+  {
+    zip::Archive archive( path.c_str() );
+    for ( int nthreads: { 1, 4, 0 } ) {
+      SafeCollect collect;
+      archive.extract( collect, nthreads );
+      XCTAssert(collect.files == files);
+    }
+    dir_remove( dir.c_str() );
+    archive.extractTo( dir.c_str(), 4 );
+    for ( auto &f: files ) 
+      XCTAssert(readFile( dir + "/" + f.first ) == f.second);
+    dir_remove( dir.c_str() );
+  }
+  unlink( path.c_str() );
+}
+
+- (void) testPipeline {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  for ( int depth: { 1, 16 } ) {
+    for ( long chunk: { 1000L, 64*1024L } ) {
+      Collect collect;
+      zip::PipelinedStream stream( collect, depth );
+      pipeArchive( stream, sink.data, chunk );
+      XCTAssert(collect.files == files);
+      XCTAssert(stream.bytesRead() == (long) sink.data.size());
+    }
+  }
+  Batches batches;
+  {
+    zip::PipelinedStream stream( batches );
+    stream.setBatching( 2 );
+    pipeArchive( stream, sink.data, 1000 );
+  }
+  int n = 0;
+  for ( int size: batches.sizes ) {
+    XCTAssert((size > 0) && (size <= 2));
+    n += size;
+  }
+  XCTAssert(n == (int) files.size());
+  // errors of the scanning thread are passed to finish
+  std::string bad = sink.data;
+  setMethod( bad, "random.bin", CopyMethod + 1 );
+  Collect collect;
+  zip::PipelinedStream stream( collect );
+  XCTAssertThrows(pipeArchive( stream, bad, 1000 ));
+}
+
+- (void) testDataDescriptor {
+  // file data looking like data descriptors and headers
+  std::string data;
+  for ( int i = 0; i < 5000; i++ ) {
+    data += std::string( "PK\x07\x08", 4 ) + std::string( 12, (char) i );
+    data += std::string( "PK\x03\x04", 4 ) + std::string( 26, 0 );
+  }
+  std::map<std::string, std::string> files;
+  files["first.bin"] = data;
+  files["second.bin"] = data.substr( 1000 );
+  // deflated with level 0 the data is kept as is in stored blocks
+  StringSink sink;
+  zip::Writer writer( sink, 2, 0 );
+  for ( auto &f: files ) 
+    writer.addFile( f.first.c_str(), f.second.data(), (long) f.second.size() );
+  writer.finish();
+  XCTAssert(sink.data.find( data.substr( 0, 1000 ) ) != std::string::npos);
+  for ( int streaming = 0; streaming < 2; streaming++ ) {
+    for ( long chunk: { 1L, 1000L, (long) sink.data.size() } ) {
+      Collect collect;
+      zip::Stream stream( collect );
+      stream.setStreaming( streaming );
+      scanArchive( stream, sink.data, chunk );
+      XCTAssert(collect.files == files);
+    }
+  }
+}
+
+- (void) testExtractor {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  std::string dir = tmpPath( "extractor" );
+  for ( int streaming = 0; streaming < 2; streaming++ ) {
+    dir_remove( dir.c_str() );
+    {
+      zip::Extractor extractor( dir.c_str() );
+      zip::Stream stream( extractor );
+      stream.setStreaming( streaming );
+      scanArchive( stream, sink.data, 4096 );
+    }
+    for ( auto &f: files ) 
+      XCTAssert(readFile( dir + "/" + f.first ) == f.second);
+  }
+  // modification times are taken from the headers
+  StringSink dated;
+  zip::Writer writer( dated );
+  time_t mtime = 1600000000;
+  writer.addFile( "a/b/dated.txt", "dated", 5, true, mtime );
+  writer.finish();
+  dir_remove( dir.c_str() );
+  {
+    zip::Extractor extractor( dir.c_str() );
+    zip::Stream stream( extractor );
+    scanArchive( stream, dated.data, 1000 );
+  }
+  struct stat st;
+  XCTAssert(stat( (dir + "/a/b/dated.txt").c_str(), &st ) == 0);
+  XCTAssert(st.st_mtime == mtime);
+  // files outside of the directory are rejected
+  StringSink evil;
+  zip::Writer other( evil );
+  other.addFile( "../evil.txt", "evil", 4 );
+  other.finish();
+  for ( int streaming = 0; streaming < 2; streaming++ ) {
+    zip::Extractor extractor( dir.c_str() );
+    zip::Stream stream( extractor );
+    stream.setStreaming( streaming );
+    XCTAssertThrows(scanArchive( stream, evil.data, 1000 ));
+  }
+  XCTAssert(access( (dir + "/../evil.txt").c_str(), F_OK ) != 0);
+  dir_remove( dir.c_str() );
+}
+
+- (void) testAcceptFile {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  for ( int streaming = 0; streaming < 2; streaming++ ) {
+    for ( long chunk: { 1000L, (long) sink.data.size() } ) {
+      Filter filter;
+      zip::Stream stream( filter );
+      stream.setStreaming( streaming );
+      scanArchive( stream, sink.data, chunk );
+      XCTAssert(filter.files.size() == files.size() - 1);
+      XCTAssert(filter.files.count( "random.bin" ) == 0);
+      XCTAssert(stream.stats().skippedFiles == 1);
+      // the skipped stored file is not copied
+      XCTAssert(stream.stats().bytesCopied < 1024);
+      for ( auto &f: filter.files ) {
+        XCTAssert(filter.raw[f.first] == (f.first == "text.txt"));
+        if ( f.first != "text.txt" ) XCTAssert(f.second == files[f.first]);
+      }
+      // the data of text.txt is the deflated stream
+      std::string &text = files["text.txt"], out;
+      unsigned long crc;
+      XCTAssert(filter.files["text.txt"].size() < text.size());
+      XCTAssert(fastInflate( filter.files["text.txt"], out, 
+                             (long) text.size(), &crc ));
+      XCTAssert(out == text);
+    }
+  }
+}
+
+- (void) testMemoryLimit {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  std::string dir = tmpPath( "spill" );
+  mkdir( dir.c_str(), 0755 );
+  for ( long chunk: { 1000L, 64*1024L, (long) sink.data.size() } ) {
+    Spilled spilled;
+    zip::Stream stream( spilled );
+    stream.setMemoryLimit( 64*1024, dir.c_str() );
+    scanArchive( stream, sink.data, chunk );
+    XCTAssert(spilled.files == files);
+    XCTAssert(spilled.exist);
+    // files larger than the limit are mapped from temporary files, which
+    // are removed with the File
+    for ( auto &f: files ) 
+      XCTAssert(spilled.paths.count( f.first ) == 
+                (f.second.size() > 64*1024));
+    for ( auto &p: spilled.paths ) {
+      XCTAssert(p.second.compare( 0, dir.size(), dir ) == 0);
+      XCTAssert(access( p.second.c_str(), F_OK ) != 0);
+    }
+  }
+  dir_remove( dir.c_str() );
+}
+
+- (void) testStats {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  for ( int streaming = 0; streaming < 2; streaming++ ) {
+    for ( int timing = 0; timing < 2; timing++ ) {
+      Collect collect;
+      zip::Stream stream( collect );
+      stream.setStreaming( streaming );
+      stream.setTiming( timing );
+      scanArchive( stream, sink.data, 1000 );
+      zip::StreamStats stats = stream.stats();
+      XCTAssert(stats.files == (long) files.size());
+      XCTAssert(stats.skippedFiles == 0);
+      // every byte read is skipped, copied or processed in place
+      XCTAssert(stats.bytesSkipped + stats.bytesCopied + stats.bytesDirect 
+                == stream.bytesRead());
+      XCTAssert(stats.bytesSkipped > 0);
+      XCTAssert(stats.bytesInflated == (long) (files["text.txt"].size() + 
+                                              files["dir/other.bin"].size()));
+      XCTAssert(stats.reallocs == stream.reallocs());
+      XCTAssert(stats.bytesMoved == stream.bytesMoved());
+      if ( timing ) {
+        XCTAssert(stats.decode > 0);
+        XCTAssert(stats.decode + stats.delegate <= stats.scan);
+      }
+      else XCTAssert(stats.scan + stats.decode + stats.delegate == 0);
+    }
+  }
+}
+
+- (void) testArena {
+  // lots of small files
+  StringSink sink;
+  std::map<std::string, std::string> files;
+  {
+    zip::Writer writer( sink );
+    for ( int i = 0; i < 500; i++ ) {
+      std::string name = "file" + std::to_string( i ), &data = files[name];
+      data = testData( 100 + 37 * i, i % 2 );
+      writer.addFile( name.c_str(), data.data(), (long) data.size(), 
+                      i % 3 != 0 );
+    }
+    writer.finish();
+  }
+  for ( int release: { 0, 10, 100 } ) {
+    Keep keep;
+    {
+      zip::Stream stream( keep );
+      stream.setArena();
+      for ( size_t pos = 0, n = 0; pos < sink.data.size(); pos += 1000 ) {
+        stream.scan( sink.data.data() + pos, 
+                     (int) std::min( (size_t) 1000, sink.data.size() - pos ) );
+        if ( release && (++n % release == 0) ) {
+          stream.releaseArena();
+          // Files of released generations stay valid until deleted
+          for ( size_t i = 0; i < keep.files.size(); i += 2 ) 
+            keep.files[i].reset();
+        }
+      }
+      stream.setArena( false );
+    }
+    // Files outlive their Stream
+    XCTAssert(keep.files.size() == files.size());
+    for ( zip::FilePtr &f: keep.files ) {
+      if ( !f ) continue;
+      XCTAssert(std::string( (const char *) f->data(), f->size() ) == 
+                files[f->name()]);
+    }
+  }
+}
+
+- (void) testRandomAccess {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  std::string path = tmpFile( "access.zip", sink.data ),
+              index = tmpPath( "access.zidx" );
+  unlink( index.c_str() );
+  {
+    zip::Archive archive( path.c_str() );
+    char buff[10];
+    XCTAssert(archive.read( archive.count(), 0, buff, 10 ) == -1);
+    // without index deflated files are inflated from their start
+    XCTAssert(!archive.loadIndex( index.c_str() ));
+    XCTAssert(readRanges( archive, files ));
+    archive.buildIndex( index.c_str(), 64*1024, 0 );
+    XCTAssert(readRanges( archive, files ));
+  }
+  {
+    zip::Archive archive( path.c_str() );
+    XCTAssert(archive.loadIndex( index.c_str() ));
+    XCTAssert(readRanges( archive, files ));
+  }
+  // an index of another archive isn't loaded
+  StringSink other;
+  zip::Writer writer( other );
+  writer.addFile( "text.txt", files["text.txt"].data(), 
+                  (long) files["text.txt"].size() / 2 );
+  writer.finish();
+  std::string otherPath = tmpFile( "other.zip", other.data );
+  {
+    zip::Archive archive( otherPath.c_str() );
+    XCTAssert(!archive.loadIndex( index.c_str() ));
+  }
+  unlink( otherPath.c_str() );
+  unlink( index.c_str() );
+  unlink( path.c_str() );
+}
+
+- (void) testReader {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  for ( int slice: { 1000, (int) zip::Reader::Slice, 1024*1024 } ) {
+    for ( long chunk: { 100L, 64*1024L, (long) sink.data.size() } ) {
+      zip::Reader reader( slice );
+      std::map<std::string, std::string> read;
+      XCTAssert(reader.needsInput());
+      XCTAssert(readArchive( reader, sink.data, chunk, read ));
+      XCTAssert(read == files);
+      XCTAssert(reader.bytesRead() == (long) sink.data.size());
+    }
+  }
+  // data is scanned lazily, the first file begins before its data is read
+  zip::Reader reader( 1000 );
+  reader.feed( sink.data.data(), (int) sink.data.size() );
+  const zip::Reader::Event *e = reader.next();
+  XCTAssert(e && (e->type == zip::Reader::Begin));
+  XCTAssert(reader.bytesRead() <= 1000);
+  // corrupt data fails the CRC check
+  std::string bad = sink.data;
+  bad[bad.find( "random.bin" ) + 10 + 1000] ^= 0x55;
+  zip::Reader other;
+  std::map<std::string, std::string> read;
+  XCTAssert(readArchive( other, bad, 4096, read ));
+  XCTAssert(read["random.bin"] == "CRC error");
+  XCTAssert(read["text.txt"] == files["text.txt"]);
+}
+
+- (void) testBuffer {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  // files crossing chunk boundaries are collected in the Buffer
+  for ( long chunk: { 1L, 7L, 4096L } ) {
+    Collect collect;
+    zip::Stream stream( collect );
+    scanArchive( stream, sink.data, chunk );
+    XCTAssert(collect.files == files);
+  }
+  // a compressed size of 2 GiB or more is rejected instead of buffered
+  std::string bad = sink.data;
+  bad[sink.data.find( "small.txt" ) - 30 + 21] |= 0x80;
+  Collect collect;
+  zip::Stream stream( collect );
+  XCTAssertThrows(scanArchive( stream, bad, 7 ));
+}
+
+- (void) testBatching {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  for ( int arena = 0; arena < 2; arena++ ) {
+    for ( int maxFiles: { 1, 2, 3 } ) {
+      Batches batches;
+      zip::Stream stream( batches );
+      stream.setArena( arena );
+      stream.setBatching( maxFiles );
+      scanArchive( stream, sink.data, 1000 );
+      int n = 0, taken = 0;
+      for ( int size: batches.sizes ) {
+        XCTAssert((size > 0) && (size <= maxFiles));
+        n += size;
+        taken += (size + 1) / 2;
+      }
+      XCTAssert(n == (int) files.size());
+      XCTAssert((int) batches.files.size() == taken);
+      for ( auto &f: batches.files ) XCTAssert(f.second == files[f.first]);
+    }
+  }
+  // batches limited by size end with the first non-empty File
+  Batches batches;
+  zip::Stream stream( batches );
+  stream.setBatching( 0, 1 );
+  scanArchive( stream, sink.data, 1000 );
+  XCTAssert(batches.sizes == std::vector<int>( { 2, 1, 1, 1 } ));
+}
+
+- (void) testCheckpoint {
+  StringSink sink;
+  std::map<std::string, std::string> files = writeArchive( sink );
+  int restored = 0;
+  // text.txt (deflated) is most of the archive
+  for ( int i = 1; i < 10; i++ ) {
+    long cut = (long) sink.data.size() * i / 20;
+    Collect collect;
+    std::string state;
+    long offset;
+    {
+      zip::Stream stream( collect );
+      stream.setStreaming();
+      scanArchive( stream, sink.data.substr( 0, cut ), 1000 );
+      offset = stream.checkpoint( state );
+    }
+    if ( offset < 0 ) continue;
+    XCTAssert(offset <= cut);
+    zip::Stream stream( collect );
+    stream.restore( state );
+    scanArchive( stream, sink.data, 1000, offset );
+    XCTAssert(collect.files == files);
+    restored += collect.resumed;
+  }
+  XCTAssert(restored > 0);
+}
+
 @end